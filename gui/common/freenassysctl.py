@@ -23,8 +23,72 @@
 # POSSIBILITY OF SUCH DAMAGE.
 #
 #####################################################################
+import struct
 import sysctl
 
+#
+# freenas.snapshot, see freenas_sysctl.h: every leaf of the tree in one
+# read rather than one sysctl per leaf.
+#
+SNAPSHOT_MAGIC = 0x53534e46
+SNAPSHOT_VERSION = 1
+SNAPSHOT_HEADER = struct.Struct('=II')
+SNAPSHOT_ENTRY = struct.Struct('=HBBI')
+SNAPSHOT_FORMATS = {
+    'I': 'i',
+    'IU': 'I',
+    'L': 'l',
+    'LU': 'L',
+    'Q': 'q',
+    'QU': 'Q',
+}
+
+
+class _oid(object):
+    def __init__(self, name, value):
+        self.name = name
+        self.value = value
+
+
+def freenas_sysctl_snapshot():
+    """
+    The freenas tree as a list of oids with a name and a value, like
+    sysctl.filter('freenas') returns, or None if the kernel module is too
+    old to have freenas.snapshot.
+    """
+    snapshot = sysctl.filter('freenas.snapshot')
+    if not snapshot:
+        return None
+
+    data = bytes(snapshot[0].value)
+    magic, version = SNAPSHOT_HEADER.unpack_from(data)
+    if magic != SNAPSHOT_MAGIC or version != SNAPSHOT_VERSION:
+        return None
+
+    oids = []
+    offset = SNAPSHOT_HEADER.size
+    while True:
+        namelen, _type, fmtlen, valuelen = SNAPSHOT_ENTRY.unpack_from(data, offset)
+        offset += SNAPSHOT_ENTRY.size
+        if namelen == 0:
+            break
+
+        name = data[offset:offset + namelen].decode()
+        offset += namelen
+        fmt = data[offset:offset + fmtlen].decode()
+        offset += fmtlen
+        value = data[offset:offset + valuelen]
+        offset += valuelen
+
+        if fmt == 'A':
+            value = value.split(b'\0', 1)[0].decode('utf-8', 'replace')
+        elif fmt in SNAPSHOT_FORMATS:
+            value = struct.unpack('@' + SNAPSHOT_FORMATS[fmt], value)[0]
+
+        oids.append(_oid('freenas.' + name, value))
+
+    return oids
+
 #
 # Magical freenas sysctl wrapper class
 #
@@ -43,7 +107,11 @@ import sysctl
 
 class freenas_sysctl(object):
     def __init__(self, *args, **kwargs):
-        for oid in sysctl.filter('freenas'):
+        oids = freenas_sysctl_snapshot()
+        if oids is None:
+            oids = sysctl.filter('freenas')
+
+        for oid in oids:
             oid_save = oid
 
             parts = oid.name.split('.')
@@ -382,7 +382,7 @@ class notifier(metaclass=HookMetaclass):
 
         return ret
 
-    def winacl_reset(self, path, owner=None, group=None, exclude=None, recursive=True):
+    def winacl_reset(self, path, owner=None, group=None, exclude=None, recursive=True, threads=None):
         if exclude is None:
             exclude = []
 
@@ -405,19 +405,22 @@ class notifier(metaclass=HookMetaclass):
             args = "%s -O '%s'" % (args, owner)
         if group is not None:
             args = "%s -G '%s'" % (args, group)
-        apply_paths = exclude_path(path, exclude)
-        apply_paths = [(y, f' {"-r " if recursive else ""}') for y in apply_paths]
-        if len(apply_paths) > 1:
-            apply_paths.insert(0, (path, ''))
-        for apath, flags in apply_paths:
-            fargs = args + "%s -p '%s'" % (flags, apath)
-            cmd = "%s %s" % (winacl, fargs)
-            log.debug("winacl_reset: cmd = %s", cmd)
-            self._system(cmd)
+        if threads and recursive:
+            args = "%s -j %d" % (args, threads)
+        if recursive:
+            args = "%s -r" % args
+            for e in exclude:
+                if isinstance(e, bytes):
+                    e = e.decode('utf-8')
+                if e.startswith(path):
+                    args = "%s -e '%s'" % (args, e)
+        cmd = "%s %s -p '%s'" % (winacl, args, path)
+        log.debug("winacl_reset: cmd = %s", cmd)
+        self._system(cmd)
 
     def mp_change_permission(self, path='/mnt', user=None, group=None,
                              mode=None, recursive=False, acl='unix',
-                             exclude=None):
+                             exclude=None, threads=None):
 
         if exclude is None:
             exclude = []
@@ -466,19 +469,19 @@ class notifier(metaclass=HookMetaclass):
                 args += " -O '%s'" % user
             if group is not None:
                 args += " -G '%s'" % group
-            args += " -a reset "
+            if threads and recursive:
+                args += " -j %d" % threads
+            args += " -a reset"
             if recursive:
-                apply_paths = exclude_path(path, exclude)
-                apply_paths = [(y, ' -r ') for y in apply_paths]
-                if len(apply_paths) > 1:
-                    apply_paths.insert(0, (path, ''))
-            else:
-                apply_paths = [(path, '')]
-            for apath, flags in apply_paths:
-                fargs = args + "%s -p '%s'" % (flags, apath)
-                cmd = "%s %s" % (script, fargs)
-                log.debug("XXX: CMD = %s", cmd)
-                self._system(cmd)
+                args += " -r"
+                for e in exclude:
+                    if isinstance(e, bytes):
+                        e = e.decode('utf-8')
+                    if e.startswith(path):
+                        args += " -e '%s'" % e
+            cmd = "%s%s -p '%s'" % (script, args, path)
+            log.debug("XXX: CMD = %s", cmd)
+            self._system(cmd)
 
         else:
             self.zfs_set_option(zfs_dataset_name, "aclmode", "passthrough", recursive)
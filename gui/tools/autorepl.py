@@ -95,6 +95,27 @@ def compress_pipecmds(compression):
     return (compress, decompress)
 
 
+#
+# Log the last line of totals pipewatcher -s wrote, which tells whether
+# zfs send (read) or the receiving end (write) was keeping us waiting.
+#
+def log_pipewatcher_stats(statsfile):
+    try:
+        with open(statsfile, 'r') as f:
+            lines = f.read().splitlines()
+        os.remove(statsfile)
+    except OSError:
+        return
+    if not lines:
+        return
+    fields = lines[-1].split('\t')
+    if len(fields) < 8:
+        return
+    log.debug('Sent %s bytes at %s MB/s on average, waited %s ms on zfs send and '
+              '%s ms on the receiving end, stalls %s/%s',
+              fields[1], fields[3], fields[4], fields[5], fields[6], fields[7])
+
+
 #
 # Attempt to send a snapshot or increamental stream to remote.
 #
@@ -103,6 +124,7 @@ def sendzfs(fromsnap, tosnap, dataset, localfs, remotefs, followdelete, throttle
     global templog
 
     progressfile = '/tmp/.repl_progress_%d' % replication.id
+    statsfile = '/tmp/.repl_stats_%d' % replication.id
     cmd = ['/sbin/zfs', 'send', '-V']
 
     # -p switch will send properties for whole dataset, including snapshots
@@ -130,7 +152,7 @@ def sendzfs(fromsnap, tosnap, dataset, localfs, remotefs, followdelete, throttle
         os.close(writefd)
 
     compress, decompress = compress_pipecmds(compression)
-    replcmd = '%s%s/usr/local/bin/pipewatcher $$ | %s "%s/sbin/zfs receive -F -d \'%s\' && echo Succeeded"' % (compress, throttle, sshcmd, decompress, remotefs)
+    replcmd = '%s%s/usr/local/bin/pipewatcher -z -s %s $$ | %s "%s/sbin/zfs receive -F -d \'%s\' && echo Succeeded"' % (compress, throttle, statsfile, sshcmd, decompress, remotefs)
     log.debug('Sending zfs snapshot: %s | %s', ' '.join(cmd), replcmd)
     with open(templog, 'w+') as f:
         readobj = os.fdopen(readfd, 'rb', 0)
@@ -145,6 +167,7 @@ def sendzfs(fromsnap, tosnap, dataset, localfs, remotefs, followdelete, throttle
         os.waitpid(zproc_pid, os.WNOHANG)
         readobj.close()
         os.remove(progressfile)
+        log_pipewatcher_stats(statsfile)
         f.seek(0)
         msg = f.read().strip('\n').strip('\r')
     os.remove(templog)
@@ -0,0 +1,73 @@
+#!/usr/local/bin/python3
+"""
+Compare two sets of --json benchmark results, say from the last release
+and from a new build, case by case.
+
+For every case in both, the throughput (MB/s where the case moved bytes,
+entries/s otherwise), system calls per entry and peak RSS are shown old
+and new, with the change in throughput. A case that got more than
+--threshold percent slower is marked, and makes the exit status 1.
+Cases found in only one of the files are listed at the end.
+
+Example:
+    compare.py 11.2-RELEASE.json new.json
+"""
+
+
+import argparse
+import sys
+
+import harness
+
+
+def throughput(record):
+    if record['mb_per_sec'] is not None:
+        return record['mb_per_sec'], 'MB/s'
+    return record['entries_per_sec'], 'entries/s'
+
+
+def show(value, fmt):
+    return '-' if value is None else fmt % value
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--threshold', type=float, default=5,
+                        help='percent slower that counts as slower')
+    parser.add_argument('old', help='results to compare against')
+    parser.add_argument('new', help='results to compare')
+    args = parser.parse_args(argv)
+
+    old = harness.load(args.old)
+    new = harness.load(args.new)
+    slower = 0
+
+    # system calls per entry and peak RSS in KB, old and new
+    print('%-15s %-28s %12s %12s %9s %8s %7s %7s %8s %8s' % (
+        'tool', 'case', 'old', 'new', 'unit', 'change', 'sc', 'sc', 'rss',
+        'rss'))
+    for key in sorted(old.keys() & new.keys()):
+        was, unit = throughput(old[key])
+        now, unit = throughput(new[key])
+        change = (now - was) / was * 100 if was else 0
+        mark = ''
+        if change < -args.threshold:
+            mark = ' slower'
+            slower += 1
+
+        print('%-15s %-28s %12.1f %12.1f %9s %+7.1f%% %7s %7s %8d %8d%s' % (
+            key[0], key[1], was, now, unit, change,
+            show(old[key]['syscalls_per_entry'], '%.2f'),
+            show(new[key]['syscalls_per_entry'], '%.2f'),
+            old[key]['max_rss_kb'], new[key]['max_rss_kb'], mark))
+
+    for key in sorted(old.keys() - new.keys()):
+        print('only in %s: %s %s' % (args.old, key[0], key[1]))
+    for key in sorted(new.keys() - old.keys()):
+        print('only in %s: %s %s' % (args.new, key[0], key[1]))
+
+    sys.exit(1 if slower else 0)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
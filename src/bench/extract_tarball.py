@@ -0,0 +1,165 @@
+#!/usr/local/bin/python3
+"""
+Measure extract-tarball throughput from a local file and over HTTP.
+
+A tarball of --size megabytes of random data and a small synthetic tree
+is built below the given directory, served from a local HTTP server,
+and extracted with every buffer size in --buffers from either source.
+Over HTTP it is also fetched with every number of -n connections in
+--connections. The best of --runs runs is reported in megabytes of
+tarball per second, see harness.py for --json.
+
+The files are created below the given directory, which should be on the
+dataset to be measured, and removed afterwards unless --keep is given.
+
+Example:
+    extract_tarball.py --size 2048 --buffers 64k,1m,8m --connections 1,4 \
+        /mnt/tank/bench
+"""
+
+
+import argparse
+import functools
+import http.server
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tarfile
+import threading
+
+import harness
+from mktree import make_tree
+
+
+def make_tarball(path, size):
+    """
+    Create the tarball of a data file and a tree, return its size and the
+    number of entries in it.
+    """
+    src = path + '.src'
+    os.mkdir(src)
+    with open(os.path.join(src, 'data'), 'wb') as f:
+        for i in range(size):
+            f.write(os.urandom(1024 * 1024))
+    entries = 2 + make_tree(os.path.join(src, 'tree'), width=4, depth=3,
+                            files=50)
+
+    # compressing random data gains nothing, so the tarball stays plain
+    with tarfile.open(path, 'w') as tar:
+        tar.add(src, arcname='src')
+    shutil.rmtree(src)
+
+    return os.path.getsize(path), entries
+
+
+class QuietHandler(http.server.SimpleHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+
+    def send_head(self):
+        """Answer "Range: bytes=<offset>-", which is all fetch(3) asks."""
+        match = re.match(r'bytes=(\d+)-$', self.headers.get('Range', ''))
+        path = self.translate_path(self.path)
+        if match is None or not os.path.isfile(path):
+            return super().send_head()
+
+        f = open(path, 'rb')
+        size = os.fstat(f.fileno()).st_size
+        offset = min(int(match.group(1)), size)
+        f.seek(offset)
+        self.send_response(206)
+        self.send_header('Content-Type', 'application/octet-stream')
+        self.send_header('Content-Length', str(size - offset))
+        self.send_header('Content-Range',
+                         'bytes %d-%d/%d' % (offset, size - 1, size))
+        self.end_headers()
+        return f
+
+    def copyfile(self, source, outputfile):
+        # a connection is closed once it has the range it wanted
+        try:
+            super().copyfile(source, outputfile)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+
+
+def serve(directory):
+    handler = functools.partial(QuietHandler, directory=directory)
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+def run(extract, url, dest, flags, buffer, connections, syscalls=False):
+    if os.path.exists(dest):
+        shutil.rmtree(dest)
+    cmd = [extract, '-u', url, '-d', dest, '-f', flags, '-b', buffer,
+           '-n', connections]
+    if syscalls:
+        return harness.count_syscalls(cmd, stdout=subprocess.DEVNULL)
+    return harness.run(cmd, stdout=subprocess.DEVNULL)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--extract-tarball', default='/usr/bin/extract-tarball',
+                        help='extract-tarball binary to benchmark')
+    parser.add_argument('--size', type=int, default=1024,
+                        help='megabytes of data in the tarball')
+    parser.add_argument('--buffers', default='64k,1m,8m',
+                        help='comma separated -b sizes to try')
+    parser.add_argument('--connections', default='1,4',
+                        help='comma separated -n connections to try over HTTP')
+    parser.add_argument('--tar-flags', default='xf',
+                        help='-f flags, as tar would get them')
+    parser.add_argument('--runs', type=int, default=3,
+                        help='runs per source and buffer, the best one counts')
+    parser.add_argument('--keep', action='store_true',
+                        help='do not remove the files when done')
+    harness.add_arguments(parser)
+    parser.add_argument('dir', help='directory to create the files in')
+    args = parser.parse_args(argv)
+    results = harness.Results(args)
+
+    work = os.path.join(args.dir, 'extract-tarball')
+    if os.path.exists(work):
+        shutil.rmtree(work)
+    os.mkdir(work)
+
+    tarball = os.path.join(work, 'bench.tar')
+    size, entries = make_tarball(tarball, args.size)
+    megabytes = size / (1024 * 1024)
+    server = serve(work)
+    http = 'http://127.0.0.1:%d/bench.tar' % server.server_port
+    sources = [('local', tarball, '1')]
+    sources += [('http', http, n) for n in args.connections.split(',')]
+    dest = os.path.join(work, 'out')
+
+    try:
+        print('%-6s %5s %8s %10s %10s %8s' % ('source', 'conns', 'buffer',
+                                              'MB/s', 'seconds', 'RSS KB'))
+        for name, url, connections in sources:
+            for buffer in args.buffers.split(','):
+                best = harness.best([run(args.extract_tarball, url, dest,
+                                         args.tar_flags, buffer, connections)
+                                     for i in range(args.runs)])
+                syscalls = run(args.extract_tarball, url, dest,
+                               args.tar_flags, buffer, connections,
+                               syscalls=True) if args.syscalls else None
+                results.add('extract-tarball',
+                            '%s -n %s -b %s' % (name, connections, buffer),
+                            best, args.runs, entries=entries, bytes=size,
+                            syscalls=syscalls)
+                print('%-6s %5s %8s %10.1f %10.3f %8d' % (
+                    name, connections, buffer, megabytes / best.seconds,
+                    best.seconds, best.max_rss_kb))
+    finally:
+        server.shutdown()
+        if not args.keep:
+            shutil.rmtree(work)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
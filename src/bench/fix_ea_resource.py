@@ -0,0 +1,119 @@
+#!/usr/local/bin/python3
+"""
+Measure how fast fix_ea fixes files with large AFP resource forks.
+
+Every file gets a corrupted DosStream.AFP_AfpInfo:$DATA and a
+DosStream.AFP_Resource:$DATA stream of --size megabytes, whose header is
+corrupted the same way. The files are then fixed with -f, with -a, and
+with both, which is where each attribute should be written out only once.
+Each run works on a fresh copy of the attributes, and the best of --runs
+runs is reported in megabytes of resource fork per second, see
+harness.py for --json.
+
+The files are created below the given directory, which should be on the
+dataset to be measured, and removed afterwards unless --keep is given.
+
+Example:
+    fix_ea_resource.py --files 20 --size 64 /mnt/tank/bench
+"""
+
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+
+import harness
+
+AFPINFO = 'DosStream.AFP_AfpInfo:$DATA'
+RESOURCE = 'DosStream.AFP_Resource:$DATA'
+
+MODES = (
+    ('fix', ['-f']),
+    ('append', ['-a']),
+    ('fix append', ['-f', '-a']),
+)
+
+
+def setextattr(path, name, value):
+    subprocess.run(['setextattr', '-i', 'user', name, path],
+                   input=value, check=True)
+
+
+def make_files(path, files, size):
+    """Create files in path, with values for fix_ea -f to fix."""
+    afpinfo = b'\0FP\0' + b'\0' * 56
+    resource = b'\0FP\0' + os.urandom(1024) * (size * 1024)
+
+    os.mkdir(path)
+    for i in range(files):
+        f = os.path.join(path, 'f%d' % i)
+        open(f, 'w').close()
+        setextattr(f, AFPINFO, afpinfo)
+        setextattr(f, RESOURCE, resource)
+
+
+def fresh(path, files, size):
+    if os.path.exists(path):
+        shutil.rmtree(path)
+    make_files(path, files, size)
+    # the values were just written, make every run start out equal
+    subprocess.run(['sync'], check=True)
+
+
+def run(fix_ea, path, args, syscalls=False):
+    cmd = [fix_ea, '-r'] + args + [path]
+    # fix_ea reads a path from stdin when it is not a tty
+    if syscalls:
+        return harness.count_syscalls(cmd, stdin=subprocess.DEVNULL,
+                                      stdout=subprocess.DEVNULL)
+    return harness.run(cmd, stdin=subprocess.DEVNULL,
+                       stdout=subprocess.DEVNULL)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--fix-ea', default='/usr/bin/fix_ea',
+                        help='fix_ea binary to benchmark')
+    parser.add_argument('--files', type=int, default=20,
+                        help='files to create')
+    parser.add_argument('--size', type=int, default=16,
+                        help='megabytes of resource fork per file')
+    parser.add_argument('--runs', type=int, default=3,
+                        help='runs per mode, the best one counts')
+    parser.add_argument('--keep', action='store_true',
+                        help='do not remove the files when done')
+    harness.add_arguments(parser)
+    parser.add_argument('dir', help='directory to create the files in')
+    args = parser.parse_args(argv)
+    results = harness.Results(args)
+
+    path = os.path.join(args.dir, 'fix_ea-resource')
+    megabytes = args.files * args.size
+
+    print('%-12s %10s %10s %8s' % ('mode', 'MB/s', 'seconds', 'RSS KB'))
+    for mode, flags in MODES:
+        runs = []
+        for i in range(args.runs):
+            fresh(path, args.files, args.size)
+            runs.append(run(args.fix_ea, path, flags))
+        best = harness.best(runs)
+
+        syscalls = None
+        if args.syscalls:
+            fresh(path, args.files, args.size)
+            syscalls = run(args.fix_ea, path, flags, syscalls=True)
+
+        results.add('fix_ea', 'resource %s' % mode, best, args.runs,
+                    entries=args.files, bytes=megabytes * 1024 * 1024,
+                    syscalls=syscalls)
+        print('%-12s %10.1f %10.3f %8d' % (mode, megabytes / best.seconds,
+                                           best.seconds, best.max_rss_kb))
+
+    if not args.keep:
+        shutil.rmtree(path)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
@@ -0,0 +1,160 @@
+#!/usr/local/bin/python3
+"""
+What the benchmarks have in common: timing a run of a tool, its peak
+RSS, counting its system calls, and writing results out in a form that
+can be compared across builds.
+
+Every benchmark prints a table as it goes, and with --json appends one
+JSON object per line to a file for each case it measured:
+
+    label               what is being measured, --label or the hostname
+    tool, case          what was run, together they name the result
+    entries, bytes      work done in a run, entries or bytes may be 0
+    seconds             the best of the runs
+    entries_per_sec     entries / seconds, or null
+    mb_per_sec          bytes / seconds in megabytes, or null
+    syscalls            system calls in a run, or null without --syscalls
+    syscalls_per_entry  syscalls / entries, or per megabyte where a tool
+                        only moves bytes
+    max_rss_kb          peak RSS of the tool over the runs
+    runs                runs the best one was picked from
+    release, time       uname -r and when the case was measured
+
+compare.py takes two such files and shows what got faster or slower.
+"""
+
+
+import json
+import os
+import platform
+import re
+import shutil
+import subprocess
+import tempfile
+import time
+
+
+class Run(object):
+    """How long a run took and the peak RSS of the measured process."""
+
+    def __init__(self, seconds, max_rss_kb):
+        self.seconds = seconds
+        self.max_rss_kb = max_rss_kb
+
+
+def wait_for(proc):
+    """Reap proc and return its peak RSS in kilobytes."""
+    pid, status, rusage = os.wait4(proc.pid, 0)
+    # what Popen makes of it, os.waitstatus_to_exitcode() needs 3.9
+    if os.WIFSIGNALED(status):
+        proc.returncode = -os.WTERMSIG(status)
+    else:
+        proc.returncode = os.WEXITSTATUS(status)
+    return rusage.ru_maxrss
+
+
+def run(cmd, **kwargs):
+    """Run cmd to completion, raise if it fails."""
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, **kwargs)
+    max_rss_kb = wait_for(proc)
+    seconds = time.monotonic() - start
+    if proc.returncode != 0:
+        raise subprocess.CalledProcessError(proc.returncode, cmd)
+    return Run(seconds, max_rss_kb)
+
+
+def best(runs):
+    """The fastest of runs, with the highest peak RSS of any of them."""
+    fastest = min(runs, key=lambda r: r.seconds)
+    return Run(fastest.seconds, max(r.max_rss_kb for r in runs))
+
+
+def traced(cmd, out):
+    """cmd under truss -c, threads and children included, counting to out."""
+    if shutil.which('truss') is None:
+        raise RuntimeError('--syscalls needs truss(1)')
+    return ['truss', '-f', '-c', '-o', out] + cmd
+
+
+def syscalls_in(out):
+    """The number of system calls in what traced() counted to out."""
+    with open(out) as f:
+        lines = [l for l in f.read().splitlines() if l.strip()]
+
+    # the summary ends in a row of dashes and the totals below it
+    match = re.match(r'\s*[\d.]+\s+(\d+)\s+\d+\s*$', lines[-1]) \
+        if lines else None
+    if match is None:
+        raise RuntimeError('cannot make out the truss -c summary')
+    return int(match.group(1))
+
+
+def count_syscalls(cmd, **kwargs):
+    """
+    Run cmd under truss and return how many system calls it made.
+    Tracing slows a tool down a lot, so this is a run of its own that is
+    never timed.
+    """
+    with tempfile.NamedTemporaryFile() as out:
+        subprocess.run(traced(cmd, out.name), check=True, **kwargs)
+        return syscalls_in(out.name)
+
+
+def add_arguments(parser):
+    """The options every benchmark takes."""
+    parser.add_argument('--json', metavar='FILE',
+                        help='append the results to FILE, one per line')
+    parser.add_argument('--label', default=platform.node(),
+                        help='what is being measured, for --json')
+    parser.add_argument('--syscalls', action='store_true',
+                        help='also count system calls, in an extra run')
+
+
+class Results(object):
+    """Where a benchmark puts what it measured, from its parsed args."""
+
+    def __init__(self, args):
+        self.path = args.json
+        self.label = args.label
+
+    def add(self, tool, case, result, runs, entries=0, bytes=0,
+            syscalls=None):
+        seconds = result.seconds
+        megabytes = bytes / (1024 * 1024)
+        # a tool that only moves bytes is charged per megabyte instead
+        per = entries or megabytes
+        record = {
+            'label': self.label,
+            'tool': tool,
+            'case': case,
+            'entries': entries,
+            'bytes': bytes,
+            'seconds': round(seconds, 6),
+            'entries_per_sec': round(entries / seconds, 1)
+            if entries else None,
+            'mb_per_sec': round(megabytes / seconds, 3) if bytes else None,
+            'syscalls': syscalls,
+            'syscalls_per_entry': round(syscalls / per, 3)
+            if syscalls is not None and per else None,
+            'max_rss_kb': result.max_rss_kb,
+            'runs': runs,
+            'release': platform.release(),
+            'time': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+        }
+
+        if self.path is not None:
+            with open(self.path, 'a') as f:
+                f.write(json.dumps(record, sort_keys=True) + '\n')
+        return record
+
+
+def load(path):
+    """The results in a --json file, the last one of each case counts."""
+    results = {}
+    with open(path) as f:
+        for line in f:
+            if line.strip():
+                record = json.loads(line)
+                results[(record['tool'], record['case'])] = record
+    return results
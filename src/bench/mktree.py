@@ -0,0 +1,104 @@
+#!/usr/local/bin/python3
+"""
+Build a synthetic directory tree to benchmark the tree walking tools on.
+
+Every directory gets --files empty regular files and, until --depth is
+reached, --width subdirectories. Of the files in a directory, --xattrs
+percent get a user extended attribute of --xattr-size bytes, named like
+the streams Samba keeps, and --acls percent get an entry of their own
+added to their NFSv4 ACL, so that the tools have something to read and
+rewrite. The attributes and ACLs are set with setextattr(8) and
+setfacl(1), a directory at a time.
+
+Example:
+    mktree.py --width 1 --depth 0 --files 200000 /mnt/tank/bench/wide
+    mktree.py --width 2 --depth 10 --files 50 /mnt/tank/bench/deep
+    mktree.py --files 1000 --xattrs 50 --acls 10 /mnt/tank/bench/mixed
+"""
+
+
+import argparse
+import os
+import subprocess
+import sys
+
+XATTR = 'DosStream.bench:$DATA'
+ACL_ENTRY = 'u:1001:rwxp::allow'
+
+
+def share(names, percent):
+    """percent out of every hundred names, spread out evenly."""
+    return [n for i, n in enumerate(names)
+            if (i + 1) * percent // 100 > i * percent // 100]
+
+
+def make_files(path, files, xattrs, xattr_size, acls):
+    """Create the files in path, with their share of xattrs and ACLs."""
+    names = [os.path.join(path, 'f%d' % i) for i in range(files)]
+    for name in names:
+        open(name, 'w').close()
+
+    if xattrs > 0:
+        value = b'x' * xattr_size
+        with_xattr = share(names, xattrs)
+        for i in range(0, len(with_xattr), 1000):
+            subprocess.run(['setextattr', '-i', 'user', XATTR] +
+                           with_xattr[i:i + 1000], input=value, check=True)
+
+    if acls > 0:
+        with_acl = share(names, acls)
+        for i in range(0, len(with_acl), 1000):
+            subprocess.run(['setfacl', '-m', ACL_ENTRY] +
+                           with_acl[i:i + 1000], check=True)
+
+
+def make_tree(root, width, depth, files, xattrs=0, xattr_size=64, acls=0):
+    """Create the tree below root and return the number of entries in it."""
+    count = 0
+    stack = [(root, depth)]
+
+    while stack:
+        path, left = stack.pop()
+        os.mkdir(path)
+        count += 1
+
+        make_files(path, files, xattrs, xattr_size, acls)
+        count += files
+
+        if left > 0:
+            stack.extend(
+                (os.path.join(path, 'd%d' % i), left - 1) for i in range(width)
+            )
+
+    return count
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--width', type=int, default=4,
+                        help='subdirectories per directory')
+    parser.add_argument('--depth', type=int, default=4,
+                        help='levels of subdirectories below the root')
+    parser.add_argument('--files', type=int, default=100,
+                        help='regular files per directory')
+    parser.add_argument('--xattrs', type=int, default=0,
+                        help='percent of files with an extended attribute')
+    parser.add_argument('--xattr-size', type=int, default=64,
+                        help='bytes in each extended attribute')
+    parser.add_argument('--acls', type=int, default=0,
+                        help='percent of files with an ACL entry of their own')
+    parser.add_argument('root', help='directory to create, must not exist')
+    args = parser.parse_args(argv)
+
+    if os.path.exists(args.root):
+        parser.error('%s already exists' % args.root)
+    if not 0 <= args.xattrs <= 100 or not 0 <= args.acls <= 100:
+        parser.error('--xattrs and --acls take a percentage')
+
+    print('%d entries' % make_tree(args.root, args.width, args.depth,
+                                   args.files, args.xattrs, args.xattr_size,
+                                   args.acls))
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
@@ -0,0 +1,101 @@
+#!/usr/local/bin/python3
+"""
+Write a stream of synthetic data to stdout, to push through pipewatcher
+or anything else that sits in a pipe.
+
+--size megabytes are written in writes of --chunk bytes. The data is
+--pattern: random, which no compressor gains anything on, text, lines
+of a directory listing that compress well, or zero. With
+--rate the stream is held to that many megabytes per second, the way a
+slow disk or network would feed it, otherwise it goes as fast as the
+reader takes it.
+
+Example:
+    pipegen.py --size 4096 --pattern text | pipewatcher -c lz4 $$ >/dev/null
+"""
+
+
+import argparse
+import os
+import sys
+import time
+
+# the data is cut from a block this long, so random data does not repeat
+# within the window of any compressor
+BLOCK = 16 * 1024 * 1024
+
+
+def make_block(pattern):
+    if pattern == 'random':
+        return os.urandom(BLOCK)
+    if pattern == 'zero':
+        return bytes(BLOCK)
+
+    # a megabyte of listing, and the rest of the block the same with the
+    # digits shuffled around, which is as compressible and a lot quicker
+    lines = []
+    size = 0
+    i = 0
+    while size < 1024 * 1024:
+        line = ('%08d drwxr-xr-x  2 user%d  wheel  %d Jan %2d 12:%02d '
+                'file%d.dat\n' % (i, i % 7, i * 37 % 100000, i % 28 + 1,
+                                     i % 60, i)).encode()
+        lines.append(line)
+        size += len(line)
+        i += 1
+    text = b''.join(lines)[:1024 * 1024]
+
+    digits = b'0123456789'
+    blocks = []
+    for i in range(BLOCK // len(text)):
+        shuffled = digits[i % 10:] + digits[:i % 10]
+        if i >= 10:
+            shuffled = shuffled[::-1]
+        blocks.append(text.translate(bytes.maketrans(digits, shuffled)))
+    return b''.join(blocks)
+
+
+def generate(out, size, pattern, chunk, rate=None):
+    """Write size bytes of pattern to the file descriptor out."""
+    block = memoryview(make_block(pattern))
+    start = time.monotonic()
+    written = 0
+    offset = 0
+
+    while written < size:
+        n = min(chunk, size - written, BLOCK - offset)
+        n = os.write(out, block[offset:offset + n])
+        written += n
+        offset = (offset + n) % BLOCK
+
+        if rate is not None:
+            ahead = written / rate - (time.monotonic() - start)
+            if ahead > 0:
+                time.sleep(ahead)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--size', type=int, default=1024,
+                        help='megabytes to write')
+    parser.add_argument('--pattern', choices=('random', 'text', 'zero'),
+                        default='random', help='what to write')
+    parser.add_argument('--chunk', type=int, default=128 * 1024,
+                        help='bytes per write')
+    parser.add_argument('--rate', type=float,
+                        help='megabytes per second to hold the stream to')
+    args = parser.parse_args(argv)
+
+    if args.chunk < 1:
+        parser.error('--chunk takes a number of bytes')
+    rate = args.rate * 1024 * 1024 if args.rate else None
+
+    try:
+        generate(sys.stdout.fileno(), args.size * 1024 * 1024, args.pattern,
+                 args.chunk, rate)
+    except BrokenPipeError:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
@@ -0,0 +1,147 @@
+#!/usr/local/bin/python3
+"""
+Measure how fast pipewatcher moves a replication stream along.
+
+A stream of --size megabytes from pipegen.py is pushed through
+pipewatcher into dd(1) writing to /dev/null, with the plain ring, a
+large ring with -P and -p, the zero-copy relay (-z), and lz4 and zstd
+compression. The compressed streams are also decompressed with -d, from
+a copy compressed ahead of time. Every --patterns pattern is tried, and
+the best of --runs runs is reported in megabytes of uncompressed stream
+per second, with the peak RSS of pipewatcher itself; see harness.py for
+--json. With --syscalls only pipewatcher's own system calls are counted,
+per megabyte of stream.
+
+The compressed copies are kept below the given directory, and removed
+afterwards unless --keep is given.
+
+Example:
+    pipewatcher_throughput.py --size 4096 --patterns random,text \
+        /mnt/tank/bench
+"""
+
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import harness
+
+PIPEGEN = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                       'pipegen.py')
+
+MODES = (
+    ('ring', []),
+    ('ring 64m', ['-b', '64m', '-P', '50', '-p', '25']),
+    ('zero-copy', ['-z']),
+    ('lz4', ['-c', 'lz4']),
+    ('zstd', ['-c', 'zstd']),
+)
+
+DECOMPRESS = (
+    ('lz4 -d', 'lz4'),
+    ('zstd -d', 'zstd'),
+)
+
+
+def source(args, pattern, compressed):
+    """The process feeding the stream, pipegen or a compressed copy."""
+    if compressed is not None:
+        return subprocess.Popen(['cat', compressed], stdout=subprocess.PIPE)
+    return subprocess.Popen([sys.executable, PIPEGEN, '--size',
+                             str(args.size), '--pattern', pattern],
+                            stdout=subprocess.PIPE)
+
+
+def run(args, pattern, flags, compressed=None, out=None, syscalls=False):
+    """
+    Push a stream through pipewatcher into dd, or into out when given,
+    and return the run, or the number of system calls with syscalls.
+    """
+    start = time.monotonic()
+    src = source(args, pattern, compressed)
+    cmd = [args.pipewatcher] + flags + [str(src.pid)]
+
+    with tempfile.NamedTemporaryFile() as trace:
+        if syscalls:
+            cmd = harness.traced(cmd, trace.name)
+        pw = subprocess.Popen(cmd, stdin=src.stdout, stdout=out or
+                              subprocess.PIPE)
+        src.stdout.close()
+        if out is None:
+            sink = subprocess.Popen(['dd', 'of=/dev/null', 'bs=1m'],
+                                    stdin=pw.stdout,
+                                    stderr=subprocess.DEVNULL)
+            pw.stdout.close()
+
+        max_rss_kb = harness.wait_for(pw)
+        failed = src.wait() != 0 or pw.returncode != 0
+        if out is None:
+            failed = sink.wait() != 0 or failed
+        seconds = time.monotonic() - start
+        if failed:
+            raise subprocess.CalledProcessError(pw.returncode, cmd)
+
+        if syscalls:
+            return harness.syscalls_in(trace.name)
+    return harness.Run(seconds, max_rss_kb)
+
+
+def measure(args, results, pattern, mode, flags, compressed=None):
+    best = harness.best([run(args, pattern, flags, compressed)
+                         for i in range(args.runs)])
+    syscalls = run(args, pattern, flags, compressed, syscalls=True) \
+        if args.syscalls else None
+    results.add('pipewatcher', '%s %s' % (pattern, mode), best, args.runs,
+                bytes=args.size * 1024 * 1024, syscalls=syscalls)
+    print('%-7s %-10s %10.1f %10.3f %8d' % (pattern, mode,
+                                            args.size / best.seconds,
+                                            best.seconds, best.max_rss_kb))
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--pipewatcher', default='/usr/local/bin/pipewatcher',
+                        help='pipewatcher binary to benchmark')
+    parser.add_argument('--size', type=int, default=2048,
+                        help='megabytes in the stream')
+    parser.add_argument('--patterns', default='random,text',
+                        help='comma separated pipegen.py patterns to try')
+    parser.add_argument('--runs', type=int, default=3,
+                        help='runs per pattern and mode, the best one counts')
+    parser.add_argument('--keep', action='store_true',
+                        help='do not remove the compressed copies when done')
+    harness.add_arguments(parser)
+    parser.add_argument('dir', help='directory to keep compressed copies in')
+    args = parser.parse_args(argv)
+    results = harness.Results(args)
+
+    work = os.path.join(args.dir, 'pipewatcher')
+    if os.path.exists(work):
+        shutil.rmtree(work)
+    os.mkdir(work)
+
+    try:
+        print('%-7s %-10s %10s %10s %8s' % ('pattern', 'mode', 'MB/s',
+                                            'seconds', 'RSS KB'))
+        for pattern in args.patterns.split(','):
+            for mode, flags in MODES:
+                measure(args, results, pattern, mode, flags)
+
+            for mode, algorithm in DECOMPRESS:
+                compressed = os.path.join(work, '%s.%s' % (pattern,
+                                                           algorithm))
+                with open(compressed, 'wb') as out:
+                    run(args, pattern, ['-c', algorithm], out=out)
+                measure(args, results, pattern, mode, ['-d'], compressed)
+    finally:
+        if not args.keep:
+            shutil.rmtree(work)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
@@ -0,0 +1,105 @@
+#!/usr/local/bin/python3
+"""
+Compare winacl and cloneacl traversal speed on a wide and a deep
+synthetic tree.
+
+Each tree is walked with the sorted fts walker (-F, how winacl always
+used to walk), the fts walker without sorting (-F -u), the descriptor
+relative walker, and the descriptor relative walker trusting d_type (-u),
+and then cloned onto itself by cloneacl with and without -i. Out of
+every hundred files, --acls start out with an ACL entry of their own
+and --xattrs with an extended attribute. The best of --runs runs is
+reported in entries per second, see harness.py for --json.
+
+The trees are created below the given directory, which should be on the
+dataset to be measured, and removed afterwards unless --keep is given.
+
+Example:
+    winacl_traverse.py --runs 5 /mnt/tank/bench
+"""
+
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+
+import harness
+from mktree import make_tree
+
+SHAPES = (
+    # a single directory full of files, where sorting hurts most
+    ('wide', dict(width=1, depth=0, files=200000)),
+    # long paths, where path based lookups hurt most
+    ('deep', dict(width=2, depth=10, files=50)),
+)
+
+MODES = (
+    ('winacl', 'fts sorted', ['-F']),
+    ('winacl', 'fts unsorted', ['-F', '-u']),
+    ('winacl', 'openat', []),
+    ('winacl', 'openat d_type', ['-u']),
+    ('cloneacl', 'clone', []),
+    ('cloneacl', 'clone changed', ['-i']),
+)
+
+
+def command(binary, tool, path, args):
+    if tool == 'cloneacl':
+        # the tree's own root is the source
+        return [binary, '-p', path] + args
+    return [binary, '-a', 'reset', '-r', '-p', path] + args
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--winacl', default='/usr/local/bin/winacl',
+                        help='winacl binary to benchmark')
+    parser.add_argument('--cloneacl', default='/usr/local/bin/cloneacl',
+                        help='cloneacl binary to benchmark')
+    parser.add_argument('--acls', type=int, default=0,
+                        help='percent of files with an ACL entry of their own')
+    parser.add_argument('--xattrs', type=int, default=0,
+                        help='percent of files with an extended attribute')
+    parser.add_argument('--runs', type=int, default=3,
+                        help='runs per tree and mode, the best one counts')
+    parser.add_argument('--keep', action='store_true',
+                        help='do not remove the trees when done')
+    harness.add_arguments(parser)
+    parser.add_argument('dir', help='directory to create the trees in')
+    args = parser.parse_args(argv)
+    results = harness.Results(args)
+    binaries = {'winacl': args.winacl, 'cloneacl': args.cloneacl}
+
+    print('%-6s %-8s %-14s %12s %10s %8s' % ('tree', 'tool', 'mode',
+                                             'entries/s', 'seconds', 'RSS KB'))
+    for name, shape in SHAPES:
+        path = os.path.join(args.dir, 'winacl-%s' % name)
+        if os.path.exists(path):
+            shutil.rmtree(path)
+        entries = make_tree(path, xattrs=args.xattrs, acls=args.acls,
+                            **shape)
+
+        try:
+            for tool, mode, flags in MODES:
+                cmd = command(binaries[tool], tool, path, flags)
+                # one run to warm the caches, so every mode starts out equal
+                harness.run(cmd, stdout=subprocess.DEVNULL)
+                best = harness.best([harness.run(cmd,
+                                                 stdout=subprocess.DEVNULL)
+                                     for i in range(args.runs)])
+                syscalls = harness.count_syscalls(
+                    cmd, stdout=subprocess.DEVNULL) if args.syscalls else None
+                results.add(tool, '%s %s' % (name, mode), best, args.runs,
+                            entries=entries, syscalls=syscalls)
+                print('%-6s %-8s %-14s %12.0f %10.3f %8d' % (
+                    name, tool, mode, entries / best.seconds, best.seconds,
+                    best.max_rss_kb))
+        finally:
+            if not args.keep:
+                shutil.rmtree(path)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
@@ -0,0 +1,169 @@
+/*-
+ * Copyright 2018 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * SHA-256 of the tarball as it goes by, for -c.
+ *
+ * The hashing is done on a thread of its own, one piece behind: while
+ * libarchive decompresses the piece read_source() just handed out, the
+ * same piece is being hashed. read_source() waits for the hash to be done
+ * with it before it gets the next one, which is when the piece may go
+ * away. OpenSSL picks the SHA extensions or AVX2 code for the CPU we run
+ * on by itself.
+ */
+
+#include <sys/types.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extract-tarball.h"
+
+struct checksum {
+	EVP_MD_CTX *ctx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	const void *data;		/* being hashed, or NULL */
+	size_t len;
+	int done;
+};
+
+
+static void *
+checksum_main(void *arg)
+{
+	struct checksum *cs = arg;
+	uint64_t since = stage_time();
+
+	pthread_mutex_lock(&cs->lock);
+	for (;;) {
+		while (cs->data == NULL && !cs->done)
+			pthread_cond_wait(&cs->cv, &cs->lock);
+		if (cs->data == NULL)
+			break;
+
+		pthread_mutex_unlock(&cs->lock);
+		stage_idle(&stages[STAGE_HASH], &since);
+		EVP_DigestUpdate(cs->ctx, cs->data, cs->len);
+		stage_busy(&stages[STAGE_HASH], &since);
+		pthread_mutex_lock(&cs->lock);
+
+		cs->data = NULL;
+		pthread_cond_broadcast(&cs->cv);
+	}
+	pthread_mutex_unlock(&cs->lock);
+	stage_idle(&stages[STAGE_HASH], &since);
+
+	return (NULL);
+}
+
+struct checksum *
+checksum_start(void)
+{
+	struct checksum *cs;
+
+	if ((cs = calloc(1, sizeof(*cs))) == NULL)
+		return (NULL);
+
+	if ((cs->ctx = EVP_MD_CTX_create()) == NULL ||
+		EVP_DigestInit_ex(cs->ctx, EVP_sha256(), NULL) != 1) {
+		EVP_MD_CTX_destroy(cs->ctx);
+		free(cs);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&cs->lock, NULL);
+	pthread_cond_init(&cs->cv, NULL);
+	if (pthread_create(&cs->thread, NULL, checksum_main, cs) != 0) {
+		pthread_cond_destroy(&cs->cv);
+		pthread_mutex_destroy(&cs->lock);
+		EVP_MD_CTX_destroy(cs->ctx);
+		free(cs);
+		return (NULL);
+	}
+
+	return (cs);
+}
+
+/* until the piece last handed to checksum_update() has been hashed */
+void
+checksum_wait(struct checksum *cs)
+{
+	struct stage *dec = &stages[STAGE_DECOMPRESS];
+
+	pthread_mutex_lock(&cs->lock);
+	if (cs->data != NULL) {
+		stage_busy(dec, &dec->since);
+		while (cs->data != NULL)
+			pthread_cond_wait(&cs->cv, &cs->lock);
+		stage_idle(dec, &dec->since);
+	}
+	pthread_mutex_unlock(&cs->lock);
+}
+
+/* hash data, which must stay put until checksum_wait() */
+void
+checksum_update(struct checksum *cs, const void *data, size_t len)
+{
+	checksum_wait(cs);
+
+	pthread_mutex_lock(&cs->lock);
+	cs->data = data;
+	cs->len = len;
+	pthread_cond_signal(&cs->cv);
+	pthread_mutex_unlock(&cs->lock);
+}
+
+/* the hash of everything so far into sum, SHA256_HEX_LEN + 1 long */
+void
+checksum_finish(struct checksum *cs, char *sum)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int i, len = 0;
+
+	pthread_mutex_lock(&cs->lock);
+	while (cs->data != NULL)
+		pthread_cond_wait(&cs->cv, &cs->lock);
+	cs->done = 1;
+	pthread_cond_signal(&cs->cv);
+	pthread_mutex_unlock(&cs->lock);
+
+	pthread_join(cs->thread, NULL);
+
+	EVP_DigestFinal_ex(cs->ctx, md, &len);
+	for (i = 0;i < len && i * 2 < SHA256_HEX_LEN;i++)
+		snprintf(sum + i * 2, 3, "%02x", md[i]);
+	sum[i * 2] = '\0';
+
+	EVP_MD_CTX_destroy(cs->ctx);
+	pthread_cond_destroy(&cs->cv);
+	pthread_mutex_destroy(&cs->lock);
+	free(cs);
+}
@@ -0,0 +1,450 @@
+/*-
+ * Copyright 2018 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The fetching stage, on threads of its own so that the network keeps
+ * going while the tarball is decompressed and written out.
+ *
+ * Over several connections, the tarball is cut into ranges that the
+ * connection threads take in order, each fetching its range into a slot
+ * of a ring twice as long as there are connections. The extracting
+ * thread gets the slots back in tarball order, and a slot is only reused
+ * for a later range once the extracting thread is done with it, so a
+ * fast connection cannot run more than the ring ahead of a slow one, and
+ * nobody can run ahead of extraction by more than the ring.
+ *
+ * A single stream, or a local file that cannot be mapped, is read into
+ * a ring of STREAM_SLOTS the same way, by one thread with read_stream().
+ *
+ * fetch(3) asks for a range with "Range: bytes=<offset>-", there is no
+ * way to give it an end. A connection reads what it needs and closes,
+ * which is also what a range fetch does in fetch(1).
+ *
+ * When a connection fails or stalls, the range is asked for again from
+ * the last byte that made it into the slot, up to RETRIES times in a row
+ * with no progress in between.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <fetch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extract-tarball.h"
+
+#define	RANGE_SIZE	(8 * 1024 * 1024)	/* smallest range asked for */
+
+enum {
+	SLOT_FREE,
+	SLOT_BUSY,
+	SLOT_DONE,
+	SLOT_FAILED
+};
+
+struct slot {
+	char *buf;
+	size_t len;
+	size_t have;			/* made it into buf so far */
+	int state;
+	char error[FETCH_ERROR_LEN];	/* why the last fetch of it failed */
+};
+
+struct download {
+	const char *url;
+	off_t size;
+	size_t range;
+	int nranges;
+	struct slot *slots;
+	int nslots;
+	int next;			/* range to fetch next */
+	int head;			/* range to hand out next */
+	int held;			/* head is being extracted */
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	pthread_t threads[MAX_CONNECTIONS];
+	int nthreads;
+	struct source *src;		/* for download_stream() */
+};
+
+
+static void
+download_free(struct download *dl)
+{
+	int i;
+
+	for (i = 0;dl->slots != NULL && i < dl->nslots;i++)
+		free(dl->slots[i].buf);
+	free(dl->slots);
+	pthread_cond_destroy(&dl->cv);
+	pthread_mutex_destroy(&dl->lock);
+	free(dl);
+}
+
+/*
+ * fetch(3) keeps its errors in globals, and sets up TLS without the
+ * locking OpenSSL 1.0.2 needs to be used from several threads. So
+ * connections are opened and closed one at a time, with the error
+ * copied out before the next one can change it. Reading from them is
+ * left to each thread.
+ */
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* fetch(3) the url from offset on */
+FILE *
+fetch_at(const char *url, off_t offset, char *error)
+{
+	struct url *u;
+	struct url_stat us;
+	FILE *fp = NULL;
+	off_t got = offset;
+
+	pthread_mutex_lock(&fetch_lock);
+	if ((u = fetchParseURL(url)) != NULL) {
+		u->offset = offset;
+		fp = fetchXGet(u, &us, "");
+		got = u->offset;
+		fetchFreeURL(u);
+	}
+
+	/* a server that ignores Range: sends it all, from offset 0 */
+	if (fp != NULL && got != offset) {
+		snprintf(error, FETCH_ERROR_LEN, "server sent offset %jd instead",
+			(intmax_t)got);
+		fclose(fp);
+		fp = NULL;
+	} else if (fp == NULL)
+		strlcpy(error, fetchLastErrString, FETCH_ERROR_LEN);
+	pthread_mutex_unlock(&fetch_lock);
+
+	return (fp);
+}
+
+/* closing a fetch(3) stream tears down its TLS as well */
+void
+fetch_close(FILE *fp)
+{
+	pthread_mutex_lock(&fetch_lock);
+	fclose(fp);
+	pthread_mutex_unlock(&fetch_lock);
+}
+
+/* why fp ended before it was supposed to */
+void
+fetch_ended(FILE *fp, char *error)
+{
+	if (ferror(fp))
+		strlcpy(error, strerror(errno), FETCH_ERROR_LEN);
+	else
+		strlcpy(error, "connection closed early", FETCH_ERROR_LEN);
+}
+
+/* whether url can be fetched in ranges, by asking for its last byte */
+int
+fetch_ranges(const char *url, off_t size, char *error)
+{
+	FILE *fp;
+
+	if ((fp = fetch_at(url, size - 1, error)) == NULL)
+		return (-1);
+	fetch_close(fp);
+
+	return (0);
+}
+
+/* wait a little longer every time the same range fails again */
+int
+fetch_retry(const char *url, off_t offset, int tries, const char *error)
+{
+	if (tries > RETRIES) {
+		warnx("%s: giving up at offset %jd: %s", url, (intmax_t)offset,
+			error);
+		return (-1);
+	}
+
+	warnx("%s: resuming at offset %jd: %s", url, (intmax_t)offset, error);
+	sleep(tries);
+
+	return (0);
+}
+
+static int
+fetch_range(struct download *dl, off_t offset, struct slot *s)
+{
+	FILE *fp;
+	size_t len;
+	int stop, tries = 0;
+
+	while (s->have < s->len) {
+		pthread_mutex_lock(&dl->lock);
+		stop = dl->stop;
+		pthread_mutex_unlock(&dl->lock);
+		if (stop)
+			return (-1);
+
+		if ((fp = fetch_at(dl->url, offset + s->have, s->error)) != NULL) {
+			while (s->have < s->len && (len = fread(s->buf + s->have,
+				1, s->len - s->have, fp)) > 0) {
+				s->have += len;
+				tries = 0;
+			}
+			if (s->have < s->len)
+				fetch_ended(fp, s->error);
+			fetch_close(fp);
+			if (s->have == s->len)
+				break;
+		}
+
+		if (fetch_retry(dl->url, offset + s->have, ++tries, s->error) < 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
+static void *
+connection_main(void *arg)
+{
+	struct download *dl = arg;
+	struct slot *s;
+	off_t offset;
+	uint64_t since = stage_time();
+	int i, ret;
+
+	pthread_mutex_lock(&dl->lock);
+	for (;;) {
+		while (!dl->stop && dl->next < dl->nranges &&
+			dl->next >= dl->head + dl->nslots)
+			pthread_cond_wait(&dl->cv, &dl->lock);
+		if (dl->stop || dl->next == dl->nranges)
+			break;
+
+		i = dl->next++;
+		s = &dl->slots[i % dl->nslots];
+		offset = (off_t)i * dl->range;
+		s->len = MIN((off_t)dl->range, dl->size - offset);
+		s->have = 0;
+		s->state = SLOT_BUSY;
+		pthread_mutex_unlock(&dl->lock);
+		stage_idle(&stages[STAGE_FETCH], &since);
+
+		ret = fetch_range(dl, offset, s);
+		stage_busy(&stages[STAGE_FETCH], &since);
+
+		pthread_mutex_lock(&dl->lock);
+		s->state = ret < 0 ? SLOT_FAILED : SLOT_DONE;
+		pthread_cond_broadcast(&dl->cv);
+	}
+	pthread_mutex_unlock(&dl->lock);
+	stage_idle(&stages[STAGE_FETCH], &since);
+
+	return (NULL);
+}
+
+/* a slot that is done with nothing in it is the end */
+static void *
+stream_main(void *arg)
+{
+	struct download *dl = arg;
+	struct slot *s;
+	ssize_t len;
+	uint64_t since = stage_time();
+
+	pthread_mutex_lock(&dl->lock);
+	for (;;) {
+		while (!dl->stop && dl->next >= dl->head + dl->nslots)
+			pthread_cond_wait(&dl->cv, &dl->lock);
+		if (dl->stop)
+			break;
+
+		s = &dl->slots[dl->next++ % dl->nslots];
+		s->state = SLOT_BUSY;
+		pthread_mutex_unlock(&dl->lock);
+		stage_idle(&stages[STAGE_FETCH], &since);
+
+		len = read_stream(dl->src, s->buf, dl->range);
+		stage_busy(&stages[STAGE_FETCH], &since);
+
+		pthread_mutex_lock(&dl->lock);
+		s->len = s->have = MAX(len, 0);
+		s->state = len < 0 ? SLOT_FAILED : SLOT_DONE;
+		pthread_cond_broadcast(&dl->cv);
+		if (len <= 0)
+			break;
+	}
+	pthread_mutex_unlock(&dl->lock);
+	stage_idle(&stages[STAGE_FETCH], &since);
+
+	return (NULL);
+}
+
+static struct download *
+download_new(size_t range, int nslots)
+{
+	struct download *dl;
+	int i;
+
+	if ((dl = calloc(1, sizeof(*dl))) == NULL)
+		return (NULL);
+	pthread_mutex_init(&dl->lock, NULL);
+	pthread_cond_init(&dl->cv, NULL);
+
+	dl->range = range;
+	dl->nslots = nslots;
+	if ((dl->slots = calloc(dl->nslots, sizeof(*dl->slots))) == NULL) {
+		download_free(dl);
+		return (NULL);
+	}
+	for (i = 0;i < dl->nslots;i++) {
+		if ((dl->slots[i].buf = malloc(dl->range)) == NULL) {
+			download_free(dl);
+			return (NULL);
+		}
+	}
+
+	return (dl);
+}
+
+/*
+ * Start fetching size bytes of url over connections connections, in
+ * ranges of at least bufsize bytes.
+ */
+struct download *
+download_start(const char *url, off_t size, size_t bufsize, int connections)
+{
+	struct download *dl;
+	size_t range;
+	int i, nranges;
+
+	range = MAX(bufsize, RANGE_SIZE);
+	nranges = (size + range - 1) / range;
+	if ((dl = download_new(range, MIN(connections * 2, MAX(nranges, 1)))) ==
+		NULL)
+		return (NULL);
+
+	dl->url = url;
+	dl->size = size;
+	dl->nranges = nranges;
+	for (i = 0;i < MIN(connections, dl->nslots);i++) {
+		if (pthread_create(&dl->threads[i], NULL, connection_main, dl) != 0)
+			break;
+		dl->nthreads++;
+	}
+	if (dl->nthreads == 0) {
+		download_free(dl);
+		return (NULL);
+	}
+
+	return (dl);
+}
+
+struct download *
+download_stream(struct source *src)
+{
+	struct download *dl;
+
+	if ((dl = download_new(src->bufsize, STREAM_SLOTS)) == NULL)
+		return (NULL);
+
+	dl->src = src;
+	dl->nranges = INT_MAX;
+	if (pthread_create(&dl->threads[0], NULL, stream_main, dl) != 0) {
+		download_free(dl);
+		return (NULL);
+	}
+	dl->nthreads = 1;
+
+	return (dl);
+}
+
+/* the next range in tarball order, valid until the next call */
+ssize_t
+download_read(struct download *dl, const void **data)
+{
+	struct stage *dec = &stages[STAGE_DECOMPRESS];
+	struct slot *s;
+	ssize_t len;
+
+	pthread_mutex_lock(&dl->lock);
+	if (dl->held) {
+		dl->slots[dl->head % dl->nslots].state = SLOT_FREE;
+		dl->head++;
+		dl->held = 0;
+		pthread_cond_broadcast(&dl->cv);
+	}
+
+	if (dl->head == dl->nranges) {
+		pthread_mutex_unlock(&dl->lock);
+		return (0);
+	}
+
+	s = &dl->slots[dl->head % dl->nslots];
+	if (s->state == SLOT_FREE || s->state == SLOT_BUSY) {
+		stage_busy(dec, &dec->since);
+		while (s->state == SLOT_FREE || s->state == SLOT_BUSY)
+			pthread_cond_wait(&dl->cv, &dl->lock);
+		stage_idle(dec, &dec->since);
+	}
+
+	if (s->state == SLOT_FAILED) {
+		len = -1;
+	} else if (s->len == 0) {
+		len = 0;
+	} else {
+		*data = s->buf;
+		len = s->len;
+		dl->held = 1;
+	}
+	pthread_mutex_unlock(&dl->lock);
+
+	return (len);
+}
+
+/* stop what is still being fetched, and free it all */
+void
+download_finish(struct download *dl)
+{
+	int i;
+
+	pthread_mutex_lock(&dl->lock);
+	dl->stop = 1;
+	pthread_cond_broadcast(&dl->cv);
+	pthread_mutex_unlock(&dl->lock);
+
+	for (i = 0;i < dl->nthreads;i++)
+		pthread_join(dl->threads[i], NULL);
+
+	download_free(dl);
+}
@@ -27,8 +27,15 @@
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <poll.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -37,73 +44,219 @@
 #include <err.h>
 #include <fetch.h>
 #include <libgen.h>
+#include <libutil.h>
+#include <time.h>
 
-ssize_t
-read_it(char *buf, size_t size, FILE *fp)
+#include "extract-tarball.h"
+
+#define	BUFFER_SIZE	(1024 * 1024)		/* -b default */
+#define	MIN_BUFFER_SIZE	(4 * 1024)
+#define	MAX_BUFFER_SIZE	(256 * 1024 * 1024)
+
+#define	STATUS_INTERVAL	1			/* seconds between status lines */
+#define	FETCH_TIMEOUT	60			/* a stalled connection is retried */
+
+struct stage stages[NSTAGES] = {
+	[STAGE_FETCH] = { .name = "fetch" },
+	[STAGE_DECOMPRESS] = { .name = "decompress" },
+	[STAGE_WRITE] = { .name = "write" },
+	[STAGE_HASH] = { .name = "sha256" },
+};
+
+uint64_t
+stage_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+/* the time since *since went to working, and *since is now */
+void
+stage_busy(struct stage *st, uint64_t *since)
+{
+	uint64_t now = stage_time();
+
+	atomic_fetch_add(&st->busy, now - *since);
+	*since = now;
+}
+
+/* the time since *since went to waiting, and *since is now */
+void
+stage_idle(struct stage *st, uint64_t *since)
+{
+	uint64_t now = stage_time();
+
+	atomic_fetch_add(&st->idle, now - *since);
+	*since = now;
+}
+
+/*
+ * The status file gets a line when we start, when we are done, and
+ * otherwise at most every STATUS_INTERVAL seconds, however small the
+ * pieces are that come in.
+ *
+ * After the name, the bytes so far and the total, every stage gets a
+ * "<stage>=<busy ms>/<idle ms>" column. The slowest stage is the one
+ * that is never idle, and the others wait on it.
+ */
+void
+update_status(struct status *s, off_t nbytes, int force)
 {
-	int fails;
-	int numfails;
-	ssize_t  nbytes;
-
-	if (buf == NULL || size <= 0 || fp == NULL)
-		return (-1);
-
-	fails = 5;
-	numfails = 0;
-
-read_again:
-	nbytes = fread(buf, 1, size, fp);
-	if (nbytes < 0) {
- 		if (errno == EINTR)
-			goto read_again;
-		else if (errno == EWOULDBLOCK || errno == EAGAIN)
+	struct timespec now;
+	int i;
+
+	if (s->fp == NULL)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC_FAST, &now);
+	if (!force && now.tv_sec - s->last < STATUS_INTERVAL)
+		return;
+	s->last = now.tv_sec;
+
+	fprintf(s->fp, "%s\t%jd\t%jd", s->name, (intmax_t)nbytes,
+		(intmax_t)s->total);
+	for (i = 0;i < NSTAGES;i++)
+		fprintf(s->fp, "\t%s=%ju/%ju", stages[i].name,
+			(uintmax_t)atomic_load(&stages[i].busy) / 1000,
+			(uintmax_t)atomic_load(&stages[i].idle) / 1000);
+	fprintf(s->fp, "\n");
+	fflush(s->fp);
+}
+
+/* (re)open the fetch(3) stream where we got to */
+static int
+fetch_source(struct source *src)
+{
+	if (src->fp != NULL)
+		fetch_close(src->fp);
+
+	while ((src->fp = fetch_at(src->url, src->offset, src->error)) == NULL) {
+		if (fetch_retry(src->url, src->offset, ++src->tries,
+			src->error) < 0)
 			return (-1);
-		else {
-			numfails++;
-			if (numfails == fails) {
-				perror("fread");
-				exit(EXIT_FAILURE);
-			}
-			goto read_again;
-		}
 	}
 
-	return (nbytes);
+	/* so that stdio does not cut our reads up into BUFSIZ pieces */
+	setvbuf(src->fp, NULL, _IOFBF, src->bufsize);
+
+	return (0);
 }
 
+/*
+ * A fetch(3) stream that fails, or ends before the size the server gave
+ * us, is opened again at the offset we got to. A descriptor that has
+ * been left non-blocking is waited on.
+ */
 ssize_t
-write_it(const char *buf, size_t size, FILE *fp)
+read_stream(struct source *src, char *buf, size_t size)
 {
-	int fails;
-	int numfails;
-	ssize_t  nbytes;
-	size_t  totalbytes;
-
-	if (buf == NULL || size <= 0 || fp == NULL)
-		return (-1);
-        
-	fails = 5;
-	numfails = 0;
-	totalbytes = 0;
-	while (totalbytes < size) {
-		nbytes = fwrite(buf + totalbytes, 1, size - totalbytes, fp);
-		if (nbytes < 0) {
-			if (errno == EINTR)
-				continue;
-			else if (errno == EWOULDBLOCK || errno == EAGAIN)
+	struct pollfd pfd;
+	ssize_t len;
+
+	if (src->fp != NULL) {
+		while ((len = fread(buf, 1, size, src->fp)) == 0 &&
+			(ferror(src->fp) || src->offset < src->size)) {
+			fetch_ended(src->fp, src->error);
+			if (fetch_retry(src->url, src->offset, ++src->tries,
+				src->error) < 0 || fetch_source(src) < 0)
+				return (-1);
+		}
+		if (len > 0)
+			src->tries = 0;
+
+	} else {
+		while ((len = read(src->fd, buf, size)) < 0) {
+			if (errno == EAGAIN) {
+				pfd.fd = src->fd;
+				pfd.events = POLLIN;
+				poll(&pfd, 1, INFTIM);
+			} else if (errno != EINTR)
 				return (-1);
-			else {
-				numfails++;
-				perror("fwrite");
-				if (numfails == fails)
-					exit(EXIT_FAILURE);
-				continue;
-			}
 		}
-		totalbytes += nbytes;
-    }
-        
-	return (totalbytes);
+	}
+
+	src->offset += len;
+	return (len);
+}
+
+/*
+ * A local tarball is mapped, and libarchive reads it straight out of the
+ * mapping with no read() copying it into a buffer of ours first. All else
+ * comes from the fetching threads of src->dl.
+ */
+ssize_t
+read_source(struct source *src, const void **data)
+{
+	ssize_t len;
+
+	/* the last piece goes away now, the hash has to be done with it */
+	if (src->cs != NULL)
+		checksum_wait(src->cs);
+
+	if (src->dl != NULL) {
+		if ((len = download_read(src->dl, data)) < 0)
+			return (-1);
+
+	} else {
+		len = MIN((off_t)src->bufsize, src->size - src->nbytes);
+		*data = src->map + src->nbytes;
+	}
+
+	src->nbytes += len;
+	update_status(src->status, src->nbytes, 0);
+	if (src->cs != NULL && len > 0)
+		checksum_update(src->cs, *data, len);
+
+	return (len);
+}
+
+/* the path if url is a local file, and NULL if fetch(3) gets it */
+static const char *
+local_path(const char *url)
+{
+	if (strncmp(url, "file://", 7) == 0)
+		return (url + 7);
+	if (strstr(url, "://") == NULL)
+		return (url);
+
+	return (NULL);
+}
+
+static int
+is_empty_dir(const char *path)
+{
+	struct dirent *de;
+	DIR *d;
+	int empty = 1;
+
+	if ((d = opendir(path)) == NULL)
+		return (0);
+	while (empty && (de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			empty = 0;
+	}
+	closedir(d);
+
+	return (empty);
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int type,
+	struct FTW *ftw)
+{
+	if (remove(path) < 0)
+		warn("%s", path);
+
+	return (0);
+}
+
+/* what is left of a staging directory that did not make it */
+static void
+remove_tree(const char *path)
+{
+	nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
 }
 
 void
@@ -111,8 +264,12 @@ usage(int argc, char **argv)
 {
 	fprintf(stderr, "Usage: %s [options]\n"
 		"Where option in:\n"
+		"  -b <buffer size>\n"
+		"  -c <sha256>\n"
 		"  -d <directory>\n"
 		"  -f <tar flags>\n"
+		"  -j <writer threads>\n"
+		"  -n <connections>\n"
 		"  -s <status file>\n"
 		"  -u <url>\n\n",
 		basename(argv[0])
@@ -121,9 +278,12 @@ usage(int argc, char **argv)
 
 void
 get_the_stuff_we_need(int argc, char **argv,
-	char **url, char **dir, char **sfile, char **tflags)
+	char **url, char **dir, char **sfile, char **tflags, char **sum,
+	size_t *bufsize, int *writers, int *connections)
 {
-	int ch;
+	uint64_t size;
+	const char *errstr;
+	int ch, i;
 
 	if (argc < 2) {
 		usage(argc, argv);
@@ -131,8 +291,32 @@ get_the_stuff_we_need(int argc, char **argv,
 	}
 
 	opterr = 0;
-	while ((ch = getopt(argc, argv, "d:f:s:u:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:c:d:f:j:n:s:u:")) != -1) {
 		switch (ch) {
+			case 'b':
+				if (expand_number(optarg, &size) < 0 ||
+					size < MIN_BUFFER_SIZE || size > MAX_BUFFER_SIZE) {
+					fprintf(stderr, "Buffer size must be between "
+						"%d and %d bytes!\n",
+						MIN_BUFFER_SIZE, MAX_BUFFER_SIZE);
+					exit(1);
+				}
+				*bufsize = size;
+				break;
+			case 'c':
+				for (i = 0;isxdigit((unsigned char)optarg[i]);i++)
+					;
+				if (i != SHA256_HEX_LEN || optarg[i] != '\0') {
+					fprintf(stderr, "A SHA-256 is %d hex digits!\n",
+						SHA256_HEX_LEN);
+					exit(1);
+				}
+				if (*sum != NULL)
+					free(*sum);
+				*sum = strdup(optarg);
+				for (i = 0;i < SHA256_HEX_LEN;i++)
+					(*sum)[i] = tolower((unsigned char)(*sum)[i]);
+				break;
 			case 'd':
 				if (*dir != NULL)
 					free(*dir);
@@ -143,6 +327,23 @@ get_the_stuff_we_need(int argc, char **argv,
 					free(*tflags);
 				*tflags = strdup(optarg);	
 				break;
+			case 'j':
+				*writers = strtonum(optarg, 1, MAX_WRITERS, &errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "Number of writers is %s!\n",
+						errstr);
+					exit(1);
+				}
+				break;
+			case 'n':
+				*connections = strtonum(optarg, 1, MAX_CONNECTIONS,
+					&errstr);
+				if (errstr != NULL) {
+					fprintf(stderr, "Number of connections is %s!\n",
+						errstr);
+					exit(1);
+				}
+				break;
 			case 's':
 				if (*sfile != NULL)
 					free(*sfile);
@@ -190,42 +391,100 @@ get_the_stuff_we_need(int argc, char **argv,
 int
 main(int argc, char **argv)
 {
-	int fd;
+	int fd, cwd, ret = 0, writers = 1, connections = 1;
+	ssize_t len;
 	struct stat st;
-	char buf[1024];
-	FILE *rfp, *fp, *sfp;
-	ssize_t rbytes, wbytes, nbytes, total_bytes;
-	char *url, *dir, *sfile, *tflags, *cmd, *file;
+	size_t bufsize = BUFFER_SIZE;
+	const char *path;
+	char *url, *dir, *sfile, *tflags, *sum, *stage, *tmp;
+	char got[SHA256_HEX_LEN + 1];
 	struct  url_stat us;
+	struct status status;
+	struct source src;
+	const void *data;
+
+	url = dir = sfile = tflags = sum = stage = NULL;
+	get_the_stuff_we_need(argc, argv, &url, &dir, &sfile, &tflags, &sum,
+		&bufsize, &writers, &connections);
+
+	memset(&status, 0, sizeof(status));
+	memset(&src, 0, sizeof(src));
+	src.url = url;
+	src.fd = -1;
+	src.bufsize = bufsize;
+	src.status = &status;
+
+	if ((path = local_path(url)) != NULL) {
+		if ((src.fd = open(path, O_RDONLY)) < 0 || fstat(src.fd, &st) < 0) {
+			perror("open");
+			exit(1);
+		}
+		if (S_ISREG(st.st_mode)) {
+			status.total = src.size = st.st_size;
+			if (src.size > 0 && (src.map = mmap(NULL, src.size,
+				PROT_READ, MAP_SHARED, src.fd, 0)) == MAP_FAILED)
+				src.map = NULL;
+			if (src.map != NULL)
+				madvise(src.map, src.size, MADV_SEQUENTIAL);
+		}
 
-	url = dir = sfile = tflags = cmd = NULL;
-	get_the_stuff_we_need(argc, argv, &url, &dir, &sfile, &tflags);
+	} else {
+		fetchTimeout = FETCH_TIMEOUT;
 
-	rfp = fetchGetURL(url, NULL);
-	if (rfp == NULL) {
-		if (fetchLastErrCode == FETCH_URL) {
-			bzero(&st, sizeof(st));
-			if (stat(url, &st) == 0) {
-				if ((rfp = fopen(url, "r")) == NULL) {
-					perror("fopen");
-					exit(1);
-				}
-				total_bytes = st.st_size;
-			}
+		bzero(&us, sizeof(us));
+		if (fetchStatURL(url, &us, NULL) >= 0 && us.size > 0)
+			status.total = src.size = us.size;
+
+		/* ranges only work out if we know where the tarball ends */
+		if (connections > 1 && src.size == 0)
+			warnx("%s: size unknown, using one connection", url);
+		else if (connections > 1 &&
+			fetch_ranges(url, src.size, src.error) < 0)
+			warnx("%s: %s, using one connection", url, src.error);
+		else if (connections > 1 && (src.dl = download_start(url,
+			src.size, bufsize, connections)) == NULL)
+			warn("%s: using one connection", url);
+
+		if (src.dl == NULL && fetch_source(&src) < 0)
+			exit(1);
+	}
+
+	/* reading ahead on a thread of its own while we decompress */
+	if (src.dl == NULL && src.map == NULL &&
+		(src.dl = download_stream(&src)) == NULL) {
+		perror("download_stream");
+		exit(1);
+	}
 
-		} else {
-			fprintf(stderr, "%s: %s\n", url, fetchLastErrString);
+	/*
+	 * With -c, nothing shows up in dir unless the whole tarball checks
+	 * out. It is extracted next to dir and renamed onto it at the end,
+	 * which only works if dir is not there yet or is empty.
+	 */
+	if (sum != NULL) {
+		if (stat(dir, &st) == 0 && !is_empty_dir(dir)) {
+			fprintf(stderr, "%s: -c needs a new or empty directory!\n",
+				dir);
 			exit(1);
 		}
+		if ((tmp = strdup(dir)) == NULL ||
+			asprintf(&stage, "%s/.extract.XXXXXX", dirname(tmp)) < 0 ||
+			mkdtemp(stage) == NULL ||
+			chmod(stage, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) < 0) {
+			perror("mkdtemp");
+			exit(1);
+		}
+		free(tmp);
 
-	} else {
-		bzero(&us, sizeof(us));
-		if (fetchStatURL(url, &us, NULL) >= 0)
-			total_bytes = us.size;
+		if ((src.cs = checksum_start()) == NULL) {
+			perror("checksum");
+			remove_tree(stage);
+			exit(1);
+		}
 	}
 
 	bzero(&st, sizeof(st));
-	if (stat(dir, &st) < 0) {
+	if (stage == NULL && stat(dir, &st) < 0) {
 		if ((fd = mkdir(dir,
 			S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH)) < 0) {
 			perror("stat");
@@ -235,47 +494,72 @@ main(int argc, char **argv)
 			warn("close");
 	}
 
-	asprintf(&cmd, "/usr/bin/tar -C '%s' -%s -", dir, tflags);
-	if ((fp = popen(cmd, "w")) == NULL) {
-		perror("popen");
+	if ((status.fp = fopen(sfile, "w")) == NULL)
+		warnx("Couldn't create status file!");
+	status.name = basename(url);
+	update_status(&status, 0, 1);
+
+	/* tar -C, the status file may be relative to where we were */
+	if ((cwd = open(".", O_RDONLY | O_DIRECTORY)) < 0 ||
+		chdir(stage != NULL ? stage : dir) < 0) {
+		perror("chdir");
+		if (stage != NULL)
+			remove_tree(stage);
 		exit(1);
 	}
-	free(cmd);
-
-	
-	if ((sfp = fopen(sfile, "w")) == NULL)
-		warnx("Couldn't create status file!");
-
-	nbytes = 0;
-	while (!feof(rfp)) {
 
-		bzero(&buf, sizeof(buf));
+	if (extract(&src, tflags, writers) < 0)
+		ret = 1;
 
-		rbytes = read_it(buf, sizeof(buf), rfp);
-		wbytes = write_it(buf, rbytes, fp);
-
-		if (rbytes != wbytes) {
-			warnx("Houston! We have a problem!\n");
-			continue;
+	/* libarchive stops at the end of the tar, what follows counts too */
+	if (src.cs != NULL && ret == 0) {
+		while ((len = read_source(&src, &data)) > 0)
+			;
+		if (len < 0) {
+			warnx("read failed");
+			ret = 1;
 		}
+	}
+	update_status(&status, src.nbytes, 1);
 
-		fprintf(sfp, "%s\t%ld\t%ld\n", basename(url), nbytes, total_bytes);
-		fflush(sfp);
+	if (src.cs != NULL) {
+		checksum_finish(src.cs, got);
+		if (ret == 0 && strcmp(got, sum) != 0) {
+			warnx("%s: SHA-256 is %s, not %s", url, got, sum);
+			ret = 1;
+		}
 
-		nbytes += wbytes;
+		if (fchdir(cwd) < 0)
+			err(1, "fchdir");
+		if (ret == 0 && rename(stage, dir) < 0) {
+			warn("rename %s to %s", stage, dir);
+			ret = 1;
+		}
+		if (ret != 0)
+			remove_tree(stage);
 	}
 
-	if (pclose(fp) < 0)
-		warn("pclose");
-	if (fclose(sfp) < 0)
+	if (src.dl != NULL)
+		download_finish(src.dl);
+	if (src.map != NULL)
+		munmap(src.map, src.size);
+	if (src.fp != NULL)
+		fetch_close(src.fp);
+	if (src.fd >= 0)
+		close(src.fd);
+
+	if (status.fp != NULL && fclose(status.fp) < 0)
 		warn("fclose");
-	if (unlink(sfile) < 0)
+	if (unlinkat(cwd, sfile, 0) < 0)
 		warn("unlink");
+	close(cwd);
 
 	free(url);
 	free(dir);
 	free(sfile);
 	free(tflags);
+	free(sum);
+	free(stage);
 
-	return (0);
+	return (ret);
 }
@@ -0,0 +1,158 @@
+/*-
+ * Copyright 2018 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef	__EXTRACT_TARBALL_H
+#define	__EXTRACT_TARBALL_H
+
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* upper bound for -j */
+#define	MAX_WRITERS	64
+
+/* upper bound for -n */
+#define	MAX_CONNECTIONS	16
+
+/* times in a row a connection is retried without getting anywhere */
+#define	RETRIES		5
+
+/* -c, in hex */
+#define	SHA256_HEX_LEN	64
+
+/* pieces a single stream reads ahead of extraction */
+#define	STREAM_SLOTS	4
+
+/* what is kept of why a fetch failed, fetch(3) keeps as much */
+#define	FETCH_ERROR_LEN	256
+
+struct checksum;
+struct download;
+
+/*
+ * The stages the tarball goes through, each in threads of its own, and
+ * how long they spent working and waiting on the stages next to them.
+ */
+enum {
+	STAGE_FETCH,
+	STAGE_DECOMPRESS,		/* with what is written inline */
+	STAGE_WRITE,
+	STAGE_HASH,
+	NSTAGES
+};
+
+struct stage {
+	const char *name;
+	atomic_uint_fast64_t busy;	/* microseconds, of all its threads */
+	atomic_uint_fast64_t idle;
+	uint64_t since;			/* for the stages of one thread */
+};
+
+extern struct stage stages[NSTAGES];
+
+struct status {
+	FILE *fp;
+	const char *name;
+	off_t total;
+	time_t last;
+};
+
+/* where the tarball comes from */
+struct source {
+	const char *url;
+	struct download *dl;	/* fetches what is not mapped */
+	struct checksum *cs;	/* hashes what is handed out, or NULL */
+	FILE *fp;		/* fetch(3) stream, or NULL */
+	int fd;			/* local file, if fp is NULL */
+	char *map;		/* all of fd, if it could be mapped */
+	off_t size;
+	size_t bufsize;
+	off_t offset;		/* where fp and fd are */
+	off_t nbytes;		/* handed out so far */
+	int tries;		/* fp failed in a row at offset */
+	char error[FETCH_ERROR_LEN];	/* why it last did */
+	struct status *status;
+};
+
+void update_status(struct status *, off_t, int);
+
+uint64_t stage_time(void);
+void stage_busy(struct stage *, uint64_t *);
+void stage_idle(struct stage *, uint64_t *);
+
+/*
+ * The next piece of the tarball, which stays valid until the next call.
+ * Return its length, 0 at the end and -1 on errors.
+ */
+ssize_t read_source(struct source *, const void **);
+
+/* read up to len bytes from fp or fd, on the thread of download_stream() */
+ssize_t read_stream(struct source *, char *, size_t);
+
+/*
+ * fetch(3) is not safe to use from several threads at once, these are.
+ * What went wrong is put in the FETCH_ERROR_LEN bytes they are given.
+ */
+FILE *fetch_at(const char *, off_t, char *);
+void fetch_close(FILE *);
+void fetch_ended(FILE *, char *);
+int fetch_ranges(const char *, off_t, char *);
+int fetch_retry(const char *, off_t, int, const char *);
+
+/*
+ * Fetch size bytes of url in ranges over several connections. The ranges
+ * come back from download_read() in order, and like read_source() each
+ * stays valid until the next call.
+ */
+struct download *download_start(const char *url, off_t size, size_t bufsize,
+	int connections);
+
+/* the same, read_stream() of src on one thread, STREAM_SLOTS ahead */
+struct download *download_stream(struct source *src);
+ssize_t download_read(struct download *, const void **);
+void download_finish(struct download *);
+
+/*
+ * SHA-256 of the pieces read_source() hands out, hashed on a thread of
+ * its own while they are being extracted.
+ */
+struct checksum *checksum_start(void);
+void checksum_wait(struct checksum *);
+void checksum_update(struct checksum *, const void *, size_t);
+void checksum_finish(struct checksum *, char *);
+
+/*
+ * Extract, or list with t, the tarball into the current directory, as
+ * tar would with tflags. With more than one writer, regular files are
+ * written out by writer threads while the tarball is decompressed.
+ * Return 0 if everything was extracted.
+ */
+int extract(struct source *, const char *tflags, int writers);
+
+#endif /* __EXTRACT_TARBALL_H */
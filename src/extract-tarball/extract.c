@@ -0,0 +1,529 @@
+/*-
+ * Copyright 2018 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * In-process extraction with libarchive, in place of piping the tarball
+ * through tar(1).
+ *
+ * libarchive decompresses and parses on the thread that calls it, with
+ * its reads coming straight out of read_source(). With -j, regular files
+ * small enough to hold in memory are read out whole and handed to writer
+ * threads, each with its own archive_write_disk handle, so that creating
+ * and writing them overlaps with decompressing what comes after. A path
+ * always goes to the same writer, so a file that is in the tarball twice
+ * still ends up as its last copy. Everything else, directories, links
+ * and large files, is written on the decompressing thread. Before that,
+ * the writer its path goes to has to catch up, in case it still has an
+ * earlier copy queued, and all of them do if it is a hard link to
+ * something they may not have written yet.
+ *
+ * Like tar(1) without -P, a leading '/' is taken off names and hard
+ * link targets, so that everything ends up below the directory.
+ *
+ * Directory times and permissions get fixed up by archive_write_close()
+ * of the handle that created them, which happens after all the writers
+ * are done and cannot touch them any more.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extract-tarball.h"
+
+#define	WRITER_QUEUE	16			/* files queued per writer */
+#define	WRITER_MAX_FILE	(1024 * 1024)		/* larger ones are written inline */
+
+struct job {
+	struct archive_entry *entry;
+	char *data;
+	size_t len;
+};
+
+struct writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	struct job jobs[WRITER_QUEUE];
+	int head;
+	int count;			/* queued, or being written */
+	int done;
+	int errors;
+	int xflags;
+};
+
+struct tar_flags {
+	int list;
+	int verbose;
+	int xflags;
+};
+
+
+/* what bsdtar does for the flags we get, z, j and the like are automatic */
+static int
+parse_tar_flags(const char *tflags, struct tar_flags *tf)
+{
+	const char *p;
+
+	memset(tf, 0, sizeof(*tf));
+	tf->xflags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_SYMLINKS |
+		ARCHIVE_EXTRACT_SECURE_NODOTDOT |
+		ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS;
+	if (geteuid() == 0)
+		tf->xflags |= ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM |
+			ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_XATTR |
+			ARCHIVE_EXTRACT_FFLAGS | ARCHIVE_EXTRACT_MAC_METADATA;
+
+	for (p = tflags;*p != '\0';p++) {
+		switch (*p) {
+			case 'x':
+			case 'f':
+			case 'z':
+			case 'j':
+			case 'J':
+			case 'y':
+			case 'a':
+				break;
+			case 't':
+				tf->list = 1;
+				break;
+			case 'v':
+				tf->verbose = 1;
+				break;
+			case 'p':
+				tf->xflags |= ARCHIVE_EXTRACT_PERM |
+					ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_XATTR |
+					ARCHIVE_EXTRACT_FFLAGS |
+					ARCHIVE_EXTRACT_MAC_METADATA;
+				break;
+			case 'o':
+				tf->xflags &= ~ARCHIVE_EXTRACT_OWNER;
+				break;
+			case 'm':
+				tf->xflags &= ~ARCHIVE_EXTRACT_TIME;
+				break;
+			case 'k':
+				tf->xflags |= ARCHIVE_EXTRACT_NO_OVERWRITE;
+				break;
+			case 'U':
+				tf->xflags |= ARCHIVE_EXTRACT_UNLINK;
+				break;
+			case 'S':
+				tf->xflags |= ARCHIVE_EXTRACT_SPARSE;
+				break;
+			default:
+				warnx("unsupported tar flag: %c", *p);
+				return (-1);
+		}
+	}
+
+	return (0);
+}
+
+
+static struct archive *
+new_disk(int xflags)
+{
+	struct archive *disk;
+
+	if ((disk = archive_write_disk_new()) == NULL) {
+		warnx("archive_write_disk_new() failed");
+		return (NULL);
+	}
+	archive_write_disk_set_options(disk, xflags);
+	archive_write_disk_set_standard_lookup(disk);
+
+	return (disk);
+}
+
+
+/*
+ * 1 if the entry failed, -1 for ARCHIVE_FATAL, which means the handle is
+ * of no more use. Exiting would leave a -c staging directory behind.
+ */
+static int
+check(struct archive *a, int r, struct archive_entry *entry)
+{
+	if (r >= ARCHIVE_OK)
+		return (0);
+
+	warnx("%s: %s", archive_entry_pathname(entry), archive_error_string(a));
+
+	return (r == ARCHIVE_FATAL ? -1 : 1);
+}
+
+
+static int
+write_job(struct archive *disk, struct job *job)
+{
+	int r, error;
+
+	error = check(disk, archive_write_header(disk, job->entry), job->entry);
+	if (error == 0 && job->len > 0 &&
+		archive_write_data(disk, job->data, job->len) < 0)
+		error = check(disk, ARCHIVE_FAILED, job->entry);
+	if (error >= 0 &&
+		(r = check(disk, archive_write_finish_entry(disk), job->entry)) != 0)
+		error = r;
+
+	return (error);
+}
+
+
+static void *
+writer_main(void *arg)
+{
+	struct writer *wr = arg;
+	struct archive *disk;
+	struct job job;
+	uint64_t since = stage_time();
+	int error;
+
+	disk = new_disk(wr->xflags);
+
+	pthread_mutex_lock(&wr->lock);
+	for (;;) {
+		while (wr->count == 0 && !wr->done)
+			pthread_cond_wait(&wr->cv, &wr->lock);
+		if (wr->count == 0)
+			break;
+
+		job = wr->jobs[wr->head];
+		pthread_mutex_unlock(&wr->lock);
+		stage_idle(&stages[STAGE_WRITE], &since);
+
+		/* without a handle, what is still queued only gets counted */
+		error = disk != NULL ? write_job(disk, &job) : 1;
+		if (error < 0) {
+			archive_write_free(disk);
+			disk = NULL;
+		}
+		archive_entry_free(job.entry);
+		free(job.data);
+		stage_busy(&stages[STAGE_WRITE], &since);
+
+		pthread_mutex_lock(&wr->lock);
+		if (error != 0)
+			wr->errors++;
+		wr->head = (wr->head + 1) % WRITER_QUEUE;
+		wr->count--;
+		pthread_cond_broadcast(&wr->cv);
+	}
+	pthread_mutex_unlock(&wr->lock);
+
+	stage_idle(&stages[STAGE_WRITE], &since);
+
+	if (disk != NULL) {
+		if (archive_write_close(disk) != ARCHIVE_OK) {
+			warnx("%s", archive_error_string(disk));
+			wr->errors++;
+		}
+		archive_write_free(disk);
+	}
+	stage_busy(&stages[STAGE_WRITE], &since);
+
+	return (NULL);
+}
+
+
+static void
+queue_job(struct writer *wr, struct job *job)
+{
+	struct stage *dec = &stages[STAGE_DECOMPRESS];
+
+	pthread_mutex_lock(&wr->lock);
+	if (wr->count == WRITER_QUEUE) {
+		stage_busy(dec, &dec->since);
+		while (wr->count == WRITER_QUEUE)
+			pthread_cond_wait(&wr->cv, &wr->lock);
+		stage_idle(dec, &dec->since);
+	}
+	wr->jobs[(wr->head + wr->count) % WRITER_QUEUE] = *job;
+	wr->count++;
+	pthread_cond_broadcast(&wr->cv);
+	pthread_mutex_unlock(&wr->lock);
+}
+
+
+/* wait for every writer to have written all it was given */
+static void
+drain_writers(struct writer *writers, int nwriters)
+{
+	struct stage *dec = &stages[STAGE_DECOMPRESS];
+	int i;
+
+	stage_busy(dec, &dec->since);
+	for (i = 0;i < nwriters;i++) {
+		pthread_mutex_lock(&writers[i].lock);
+		while (writers[i].count > 0)
+			pthread_cond_wait(&writers[i].cv, &writers[i].lock);
+		pthread_mutex_unlock(&writers[i].lock);
+	}
+	stage_idle(dec, &dec->since);
+}
+
+
+static int
+write_inline(struct archive *a, struct archive *disk,
+	struct archive_entry *entry)
+{
+	const void *data;
+	size_t len;
+	la_int64_t off;
+	int r, error;
+
+	if ((error = check(disk, archive_write_header(disk, entry), entry)) != 0)
+		return (error);
+
+	while ((r = archive_read_data_block(a, &data, &len, &off)) == ARCHIVE_OK) {
+		if (archive_write_data_block(disk, data, len, off) < 0) {
+			error = check(disk, ARCHIVE_FAILED, entry);
+			break;
+		}
+	}
+	if (error == 0 && r != ARCHIVE_EOF)
+		error = check(a, r, entry);
+
+	if (error >= 0 &&
+		(r = check(disk, archive_write_finish_entry(disk), entry)) != 0)
+		error = r;
+	return (error);
+}
+
+
+/* FNV-1a of the path, so a path always gets the same writer */
+static int
+pick_writer(const char *path, int nwriters)
+{
+	uint32_t hash = 2166136261U;
+
+	for (;*path != '\0';path++)
+		hash = (hash ^ (unsigned char)*path) * 16777619U;
+
+	return (hash % nwriters);
+}
+
+
+/* what tar(1) does without -P, false if nothing is left of the name */
+static int
+strip_absolute(struct archive_entry *entry)
+{
+	const char *name;
+	char *rel;
+
+	name = archive_entry_pathname(entry);
+	if (name[0] == '/') {
+		if ((rel = strdup(name + strspn(name, "/"))) == NULL)
+			return (-1);
+		archive_entry_copy_pathname(entry, rel);
+		free(rel);
+	}
+
+	name = archive_entry_hardlink(entry);
+	if (name != NULL && name[0] == '/') {
+		if ((rel = strdup(name + strspn(name, "/"))) == NULL)
+			return (-1);
+		archive_entry_copy_hardlink(entry, rel);
+		free(rel);
+	}
+
+	return (archive_entry_pathname(entry)[0] != '\0');
+}
+
+
+static la_ssize_t
+source_cb(struct archive *a, void *arg, const void **data)
+{
+	la_ssize_t len;
+
+	if ((len = read_source(arg, data)) < 0)
+		archive_set_error(a, errno, "read failed");
+
+	return (len);
+}
+
+
+int
+extract(struct source *src, const char *tflags, int nwriters)
+{
+	struct tar_flags tf;
+	struct archive *a, *disk;
+	struct archive_entry *entry;
+	struct writer *writers = NULL;
+	struct job job;
+	const char *path;
+	la_ssize_t len;
+	int i, r, error, errors = 0;
+
+	if (parse_tar_flags(tflags, &tf) < 0)
+		return (-1);
+	stages[STAGE_DECOMPRESS].since = stage_time();
+
+	if ((a = archive_read_new()) == NULL) {
+		warnx("archive_read_new() failed");
+		return (-1);
+	}
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	if (archive_read_open(a, src, NULL, source_cb, NULL) != ARCHIVE_OK) {
+		warnx("%s", archive_error_string(a));
+		archive_read_free(a);
+		return (-1);
+	}
+
+	if ((disk = new_disk(tf.xflags)) == NULL) {
+		archive_read_free(a);
+		return (-1);
+	}
+
+	/* with fewer writers than asked for, or none, it only gets slower */
+	if (tf.list || nwriters < 2)
+		nwriters = 0;
+	if (nwriters > 0 &&
+		(writers = calloc(nwriters, sizeof(*writers))) == NULL) {
+		warn("calloc");
+		nwriters = 0;
+	}
+	for (i = 0;i < nwriters;i++) {
+		pthread_mutex_init(&writers[i].lock, NULL);
+		pthread_cond_init(&writers[i].cv, NULL);
+		writers[i].xflags = tf.xflags;
+		if ((error = pthread_create(&writers[i].thread, NULL,
+			writer_main, &writers[i])) != 0) {
+			warnc(error, "pthread_create");
+			pthread_cond_destroy(&writers[i].cv);
+			pthread_mutex_destroy(&writers[i].lock);
+			nwriters = i;
+		}
+	}
+
+	while ((r = archive_read_next_header(a, &entry)) != ARCHIVE_EOF) {
+		/* like bsdtar, give up on the entry but not on the rest of them */
+		if (r == ARCHIVE_RETRY)
+			continue;
+		if (r < ARCHIVE_OK) {
+			warnx("%s", archive_error_string(a));
+			errors++;
+			if (r == ARCHIVE_FATAL)
+				break;
+			if (r != ARCHIVE_WARN)
+				continue;
+		}
+
+		if (tf.list) {
+			printf("%s\n", archive_entry_pathname(entry));
+			continue;
+		}
+		if ((r = strip_absolute(entry)) <= 0) {
+			if (r == 0)
+				continue;
+			warn("strdup");
+			errors++;
+			break;
+		}
+
+		path = archive_entry_pathname(entry);
+		if (tf.verbose)
+			fprintf(stderr, "x %s\n", path);
+
+		if (nwriters > 0 && archive_entry_filetype(entry) == AE_IFREG &&
+			archive_entry_hardlink(entry) == NULL &&
+			archive_entry_size(entry) <= WRITER_MAX_FILE) {
+			job.len = archive_entry_size(entry);
+			job.data = NULL;
+			if ((job.entry = archive_entry_clone(entry)) == NULL ||
+				(job.data = malloc(MAX(job.len, 1))) == NULL) {
+				warn("malloc");
+				archive_entry_free(job.entry);
+				errors++;
+				break;
+			}
+
+			if (job.len > 0 &&
+				(len = archive_read_data(a, job.data, job.len)) != job.len) {
+				if (len < 0) {
+					archive_entry_free(job.entry);
+					free(job.data);
+					errors++;
+					if (check(a, len, entry) < 0)
+						break;
+					continue;
+				}
+				job.len = len;
+			}
+
+			queue_job(&writers[pick_writer(path, nwriters)], &job);
+			continue;
+		}
+
+		if (archive_entry_hardlink(entry) != NULL)
+			drain_writers(writers, nwriters);
+		else if (nwriters > 0 && archive_entry_filetype(entry) != AE_IFDIR)
+			drain_writers(&writers[pick_writer(path, nwriters)], 1);
+		if ((error = write_inline(a, disk, entry)) != 0) {
+			errors++;
+			if (error < 0)
+				break;
+		}
+	}
+
+	for (i = 0;i < nwriters;i++) {
+		pthread_mutex_lock(&writers[i].lock);
+		writers[i].done = 1;
+		pthread_cond_broadcast(&writers[i].cv);
+		pthread_mutex_unlock(&writers[i].lock);
+	}
+	stage_busy(&stages[STAGE_DECOMPRESS], &stages[STAGE_DECOMPRESS].since);
+	for (i = 0;i < nwriters;i++) {
+		pthread_join(writers[i].thread, NULL);
+		errors += writers[i].errors;
+		pthread_cond_destroy(&writers[i].cv);
+		pthread_mutex_destroy(&writers[i].lock);
+	}
+	free(writers);
+	stage_idle(&stages[STAGE_DECOMPRESS], &stages[STAGE_DECOMPRESS].since);
+
+	if (archive_write_close(disk) != ARCHIVE_OK) {
+		warnx("%s", archive_error_string(disk));
+		errors++;
+	}
+	archive_write_free(disk);
+	archive_read_close(a);
+	archive_read_free(a);
+	stage_busy(&stages[STAGE_DECOMPRESS], &stages[STAGE_DECOMPRESS].since);
+
+	return (errors > 0 ? -1 : 0);
+}
@@ -25,48 +25,58 @@
  *
  */
 
+#include <sys/param.h>
 #include <sys/types.h>
-#include <sys/queue.h>
 #include <sys/stat.h>
-#include <sys/extattr.h>
 #include <fcntl.h>
 #include <fts.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 #include <err.h>
+#include <errno.h>
 
-#define EX_EA_CORRUPTED         1
+#include "ea.h"
 
-#define F_NONE                  0x0000
-#define F_APPEND_NULL_ALL       0x0001
-#define F_CHECK_AFP_EA          0x0002
-#define F_DRY_RUN               0x0004
-#define F_FIX_AFP_EA            0x0008
-#define F_APPEND_NULL           0x0010
-#define F_VERBOSE               0x0020
-#define F_DEBUG                 0x0040
+/* beside the EA_* flags of ea.h */
 #define F_RECURSIVE             0x0080
 
-#define AFP_EA_CORRUPTED(v)     (v[0] == 0 && v[1] == 'F' && v[2] == 'P')
+#define CHECKPOINT_INTERVAL     10      /* seconds between -k checkpoints */
 
+#define MAX_THREADS             256
+#define JOB_QUEUE_SIZE          1024
 
-struct xattr {
-	char *name;
-	char *value;
-	size_t length;
-	TAILQ_ENTRY(xattr) link;
-	TAILQ_ENTRY(xattr) afp_link;
-	TAILQ_ENTRY(xattr) append_link;
+/*
+ * fts walks in a fixed order, so -k only needs to remember the last entry
+ * everything up to which is done. The path is kept together with the
+ * length of the root it was found under, roots being allowed to contain
+ * slashes, and the exit status so far, so that corruption found before
+ * the interruption still makes the resumed run exit 1. It is only ever
+ * replaced with rename(), so an interrupted run leaves either the old or
+ * the new checkpoint behind.
+ *
+ * When resuming, an entry is compared against the component of the
+ * checkpoint at the same level. Entries that sort before it were done and
+ * are pruned whole, the entries on the way to it were done but are walked
+ * into, and the first entry after it is where work picks up again.
+ */
+struct checkpoint {
+	char *file;
+	char *tmp;
+	time_t last;
+	char **comps;		/* root, then the names below it */
+	int ncomps;
+	int resuming;
+	int rval;		/* of the run we resume, up to the path */
 };
 
-TAILQ_HEAD(xattr_list, xattr);
-
 
 void
 usage(const char *path)
@@ -79,8 +89,11 @@ usage(const char *path)
 		"     -C                # dry run (no changes are made)\n"
 		"     -d                # debug mode\n"
 		"     -f                # fix AFP extended attributes\n"
+		"     -j <threads>      # number of worker threads (with -r)\n"
+		"     -k <file>         # checkpoint to and resume from file (with -r)\n"
 		"     -n <EA>           # append null byte\n"
 		"     -r                # recursive\n"
+		"     -R                # report one record per attribute\n"
 		"     -v                # verbose\n\n"
 		"Exit codes:\n"
 		"      1 if corrupted\n"
@@ -91,345 +104,361 @@ usage(const char *path)
 	exit(EX_USAGE);
 }
 
+/* out gets what -v, -d and -R have to say */
 static int
-get_extended_attributes(int fd, struct xattr_list *xlist)
+do_ea_stuff_single(const char *path, const char *attr, u_int64_t flags,
+	struct ea_arena *a, FILE *out)
 {
-	char *buf;
-	int i, ch, ret, buflen;
-
-	if ((ret = extattr_list_fd(fd, EXTATTR_NAMESPACE_USER, NULL, 0)) < 0)
-		return (EX_OK);
-
-	if ((buf = malloc(ret)) == NULL) {
-		warn("malloc");
-		return (-1);
-	}
+	int fd, ret;
 
-	buflen = ret;
-	if ((ret = extattr_list_fd(fd, EXTATTR_NAMESPACE_USER, buf, buflen)) < 0) {
-		free(buf);
-		warn("extattr_list_fd");
-		return (-1);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		warn("open");
+		return (EX_OSERR);
 	}
 
-	for (i = 0;i < ret;i += ch + 1) {
-		struct xattr *xptr = NULL;
-		char *name, *value;
-		int getret;
-
-		ch = (unsigned char)buf[i];
-		if ((name = malloc(ch)) == NULL) {
-			warn("malloc");
-			continue;
-		}
-
-		strncpy(name, &buf[i + 1], ch);
-		name[ch] = '\0';
-
-		if (strncmp(name, "DosStream.", 10) != 0) {
-			free(name);
-			continue;
-		}
-
-		if ((getret = extattr_get_fd(fd, EXTATTR_NAMESPACE_USER,
-			name, NULL, 0)) < 0) {
-			free(name);
-			continue;
-		}
-
-		if ((value = malloc(getret)) == NULL) {
-			warn("malloc");	
-			free(name);
-			continue;
-		}
-
-		if ((getret = extattr_get_fd(fd, EXTATTR_NAMESPACE_USER,
-			name, value, getret)) < 0) {
-			free(value);
-			free(name);
-			continue;
-		}
+	ret = ea_fix_fd(fd, path, attr, flags, a, out);
+	close(fd);
 
-		if ((xptr = malloc(sizeof(*xptr))) == NULL) {
-			warn("malloc");	
-			free(value);
-			free(name);
-			continue;
-		}
-
-		memset(xptr, 0, sizeof(*xptr));
-		xptr->name = name;
-		xptr->value = value;
-		xptr->length = getret;
-
-		TAILQ_INSERT_TAIL(xlist, xptr, link);
-	}
-
-	return (0);
+	return (ret);
 }
 
 static int
-get_afp_list(struct xattr_list *xlist, struct xattr_list *afp_list)
+fts_compare(const FTSENT * const *s1, const FTSENT * const *s2)
 {
-	struct xattr *xptr = NULL;
-
-	if (xlist == NULL || afp_list == NULL)
-		return (-1);
-
-	TAILQ_FOREACH(xptr, xlist, link) {
-		if (xptr->length >= 3 && AFP_EA_CORRUPTED(xptr->value))
-			TAILQ_INSERT_TAIL(afp_list, xptr, afp_link);
-	}
-
-	return (0);
+	return (strcoll((*s1)->fts_name, (*s2)->fts_name));
 }
 
+/* a checkpoint is the root length, path and status, each on a line of its own */
 static void
-hexdump_ea(const char *path, const char *name, const char *buf, size_t length)
+checkpoint_open(struct checkpoint *ck, const char *file)
 {
-	int i;
-
-	if (path == NULL || name == NULL || buf == NULL || length == 0)
+	FILE *f;
+	char *buf, *p, *name, *status, *end;
+	size_t len, rootlen;
+	long rval;
+
+	memset(ck, 0, sizeof(*ck));
+	if ((ck->file = strdup(file)) == NULL ||
+		asprintf(&ck->tmp, "%s.tmp", file) < 0)
+		err(EX_OSERR, "malloc");
+	ck->last = time(NULL);
+
+	if ((f = fopen(file, "r")) == NULL) {
+		if (errno != ENOENT)
+			err(EX_NOINPUT, "%s", file);
 		return;
-
-	printf("%s: %s\n\t", path, name);
-	if (length < 8) {
-		for (i = 0;i < length;i++)
-			printf("%02x ", (unsigned char)buf[i]);
-	} else {
-		for (i = 0;i < 4;i++)
-			printf("%02x ", (unsigned char)buf[i]);
-		printf("/ ");
-		for (i = length - 4;i < length;i++)
-			printf("%02x ", (unsigned char)buf[i]);
-
 	}
-	printf("[%zu]\n", length);
-}
-
-static int
-fix_afp_list(int fd, const char *path,
-		u_int64_t flags, struct xattr_list *afp_list)
-{
-	int ret = 0, setret = 0;
-	struct xattr *xptr = NULL, *xtmp = NULL;
-
-	if (afp_list == NULL)
-		return (-1);
 
-	TAILQ_FOREACH(xptr, afp_list, afp_link) {
-		if (flags & F_DEBUG)
-			hexdump_ea(path, xptr->name, xptr->value, xptr->length);
-
-		if (flags & F_CHECK_AFP_EA) {
-			ret |= EX_EA_CORRUPTED;
-			if (flags & F_VERBOSE) {
-				printf("%s: %s is corrupted\n", path, xptr->name);
-			}
-		}
-
-		if (flags & F_FIX_AFP_EA) {
-			if ((flags & F_DRY_RUN) == 0) {
-				*((char *)xptr->value) = 'A';
-				if ((setret = extattr_set_fd(fd, EXTATTR_NAMESPACE_USER,
-					xptr->name, xptr->value, xptr->length)) < 0) {
-					warn("extattr_set_fd");
-					ret |= EX_EA_CORRUPTED;
-				} 
-			}
-
-			if (setret > 0 || flags & F_DRY_RUN) {
-				ret |= EX_OK;
-				if (flags & F_VERBOSE)
-					printf("%s: %s is fixed\n", path, xptr->name);
-			}
-		}
+	buf = NULL;
+	len = 0;
+	if (getdelim(&buf, &len, '\0', f) < 0 ||
+		sscanf(buf, "%zu\n", &rootlen) != 1 ||
+		(p = strchr(buf, '\n')) == NULL)
+		errx(EX_DATAERR, "%s: not a checkpoint", file);
+	fclose(f);
+
+	p++;
+	len = strlen(p);
+	if (len > 0 && p[len - 1] == '\n')
+		p[--len] = '\0';
+
+	/* the path may have newlines in it, the status is after the last one */
+	if ((status = strrchr(p, '\n')) == NULL)
+		errx(EX_DATAERR, "%s: not a checkpoint", file);
+	*status++ = '\0';
+	errno = 0;
+	rval = strtol(status, &end, 10);
+	if (*status == '\0' || *end != '\0' || errno != 0 ||
+		rval < 0 || rval > 255)
+		errx(EX_DATAERR, "%s: not a checkpoint", file);
+	ck->rval = rval;
+
+	len = strlen(p);
+	if (rootlen == 0 || rootlen > len)
+		errx(EX_DATAERR, "%s: not a checkpoint", file);
+
+	if ((ck->comps = calloc(len + 1, sizeof(*ck->comps))) == NULL ||
+		(ck->comps[0] = strndup(p, rootlen)) == NULL)
+		err(EX_OSERR, "malloc");
+	ck->ncomps = 1;
+
+	for (p += rootlen;(name = strsep(&p, "/")) != NULL;) {
+		if (*name != '\0')
+			ck->comps[ck->ncomps++] = name;
 	}
 
-	return (ret);
+	/* the names point into buf, which stays around with them */
+	ck->comps[ck->ncomps] = buf;
+	ck->resuming = 1;
 }
 
 static void
-unlink_afp_list(struct xattr_list *afp_list)
+checkpoint_close(struct checkpoint *ck)
 {
-	if (afp_list != NULL) {
-		struct xattr *xptr = NULL, *xtmp = NULL;
-
-		TAILQ_FOREACH_SAFE(xptr, afp_list, afp_link, xtmp)
-			TAILQ_REMOVE(afp_list, xptr, afp_link);
+	if (ck->comps != NULL) {
+		free(ck->comps[0]);
+		free(ck->comps[ck->ncomps]);
+		free(ck->comps);
 	}
+	free(ck->tmp);
+	free(ck->file);
 }
 
+/* return 1 if the run we resume already did entry */
 static int
-get_append_list(struct xattr_list *xlist,
-		struct xattr_list *append_list, const char *attr)
+checkpoint_done(struct checkpoint *ck, FTS *tree, FTSENT *entry)
 {
-	struct xattr *xptr = NULL;
+	int cmp;
 
-	if (xlist == NULL || append_list == NULL)
-		return (-1);
+	if (ck == NULL || !ck->resuming)
+		return (0);
 
-	TAILQ_FOREACH(xptr, xlist, link) {
-		if (attr == NULL) {
-			TAILQ_INSERT_TAIL(append_list, xptr, append_link);
+	if (entry->fts_level >= ck->ncomps) {
+		ck->resuming = 0;
+		return (0);
+	}
 
-		} else if (strcmp(xptr->name, attr) == 0) {
-			TAILQ_INSERT_TAIL(append_list, xptr, append_link);
-			break;
-		}
+	if ((cmp = strcoll(entry->fts_name, ck->comps[entry->fts_level])) > 0) {
+		ck->resuming = 0;
+		return (0);
 	}
 
-	return (0);
+	if (cmp < 0)
+		fts_set(tree, entry, FTS_SKIP);
+	else if (entry->fts_level == ck->ncomps - 1)
+		ck->resuming = 0;
+
+	return (1);
 }
 
-static int
-fix_append_list(int fd, const char *path,
-		u_int64_t flags, struct xattr_list *append_list)
+/* everything up to and including path is done, with rval as the outcome */
+static void
+checkpoint_save(struct checkpoint *ck, const char *path, size_t rootlen,
+	int rval)
 {
-	int ret = 0, setret = 0;
-	struct xattr *xptr = NULL, *xtmp = NULL;
-
-	if (append_list == NULL)
-		return (-1);
+	FILE *f;
+	time_t now;
 
-	TAILQ_FOREACH(xptr, append_list, append_link) {
-		if (flags & F_DEBUG)
-			hexdump_ea(path, xptr->name, xptr->value, xptr->length);
+	if (ck == NULL || (now = time(NULL)) - ck->last < CHECKPOINT_INTERVAL)
+		return;
+	ck->last = now;
 
-		if (flags & F_APPEND_NULL) {
-			if ((flags & F_DRY_RUN) == 0) {
-				char *buf = NULL;
-				int length = 0;
+	/* what was printed about it must not get lost with a crash either */
+	fflush(stdout);
 
-				length = xptr->length + 1;
-				if ((buf = malloc(length)) == NULL) {
-					warn("malloc");
-					return (-1);
-				}
+	if ((f = fopen(ck->tmp, "w")) == NULL) {
+		warn("%s", ck->tmp);
+		return;
+	}
 
-				memcpy(buf, xptr->value, xptr->length);
-				buf[length] = '\0';
-
-				free(xptr->value);
-				xptr->value = buf;
-				xptr->length = length;
-
-				if ((setret = extattr_set_fd(fd, EXTATTR_NAMESPACE_USER,
-					xptr->name, xptr->value, xptr->length)) < 0) {
-					warn("extattr_set_fd");
-					ret |= EX_EA_CORRUPTED;
-				} 
-			}
-
-			if (setret > 0 || flags & F_DRY_RUN) {
-				ret |= EX_OK;
-				if (flags & F_VERBOSE)
-					printf("%s: %s null byte appended\n", path, xptr->name);
-			}
-		}
+	fprintf(f, "%zu\n%s\n%d\n", rootlen, path, rval);
+	if (fclose(f) != 0) {
+		warn("%s", ck->tmp);
+		unlink(ck->tmp);
+		return;
 	}
 
-	return (ret);
+	if (rename(ck->tmp, ck->file) < 0)
+		warn("%s", ck->file);
 }
 
+/*
+ * With -j the fts walk stays on the main thread and queues the paths it
+ * finds into a ring of jobs, which the workers take in order. Whatever a
+ * job prints is kept with it, and jobs are printed strictly in the order
+ * they were queued, so output looks the same as without -j. A job's slot
+ * is only reused once it has been printed, which also bounds how far the
+ * walk can get ahead of the slowest file, and means that the job last
+ * printed is also where a -k checkpoint can be taken.
+ */
+#define JOB_FREE                0
+#define JOB_QUEUED              1
+#define JOB_RUNNING             2
+#define JOB_DONE                3
+
+struct job {
+	char *path;
+	size_t rootlen;
+	int state;
+	int ret;
+	char *out;
+	size_t outlen;
+};
+
+struct job_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t space;
+	pthread_cond_t work;
+	struct job jobs[JOB_QUEUE_SIZE];
+	u_int64_t head;         /* next to be queued */
+	u_int64_t next;         /* next to be taken */
+	u_int64_t tail;         /* next to be printed */
+	int done;
+	const char *attr;
+	u_int64_t flags;
+	struct checkpoint *ck;
+	int rval;
+};
+
 static void
-unlink_append_list(struct xattr_list *append_list)
+queue_job(struct job_queue *q, const char *path, size_t rootlen)
 {
-	if (append_list != NULL) {
-		struct xattr *xptr = NULL, *xtmp = NULL;
+	struct job *job;
+	char *p;
 
-		TAILQ_FOREACH_SAFE(xptr, append_list, append_link, xtmp)
-			TAILQ_REMOVE(append_list, xptr, append_link);
-	}
+	if ((p = strdup(path)) == NULL)
+		err(EX_OSERR, "strdup");
+
+	pthread_mutex_lock(&q->lock);
+	while (q->head - q->tail >= JOB_QUEUE_SIZE)
+		pthread_cond_wait(&q->space, &q->lock);
+
+	job = &q->jobs[q->head % JOB_QUEUE_SIZE];
+	job->path = p;
+	job->rootlen = rootlen;
+	job->state = JOB_QUEUED;
+	q->head++;
+
+	pthread_cond_signal(&q->work);
+	pthread_mutex_unlock(&q->lock);
 }
 
+/* called locked, print and free whatever is done up to the first that is not */
 static void
-free_extended_attributes(struct xattr_list *xlist)
+print_jobs(struct job_queue *q)
 {
-	if (xlist != NULL) {
-		struct xattr *xptr = NULL, *xtmp = NULL;
-
-		TAILQ_FOREACH_SAFE(xptr, xlist, link, xtmp) {
-			TAILQ_REMOVE(xlist, xptr, link);
-			free(xptr->name);
-			free(xptr->value);
-			free(xptr);
-		}
-	}
-}
+	struct job *job;
 
-static int
-do_ea_stuff_single(const char *path, const char *attr, u_int64_t flags)
-{
-	int fd = 0, setret, ret = 0;
-	struct xattr_list xlist, afp_list, append_list;
+	while (q->tail < q->next) {
+		job = &q->jobs[q->tail % JOB_QUEUE_SIZE];
+		if (job->state != JOB_DONE)
+			break;
 
-	TAILQ_INIT(&xlist);
-	TAILQ_INIT(&afp_list);
-	TAILQ_INIT(&append_list);
+		if (job->outlen > 0)
+			fwrite(job->out, 1, job->outlen, stdout);
+		q->rval |= job->ret;
+		checkpoint_save(q->ck, job->path, job->rootlen, q->rval);
 
-	if ((fd = open(path, O_RDONLY)) < 0) {
-		warn("open");
-		ret = EX_OSERR;
-		goto cleanup;
-	}
+		free(job->path);
+		free(job->out);
+		memset(job, 0, sizeof(*job));
+		q->tail++;
 
-	if (get_extended_attributes(fd, &xlist) < 0) {
-		ret = EX_DATAERR;
-		goto cleanup;
+		pthread_cond_signal(&q->space);
 	}
+}
 
-	if (flags & F_CHECK_AFP_EA || flags & F_FIX_AFP_EA) {
-		get_afp_list(&xlist, &afp_list);
-		if ((setret = fix_afp_list(fd, path, flags, &afp_list)) < 0) {
-			ret = EX_DATAERR;
-			goto cleanup;
-		}
-		ret = setret;
-	}
+static void *
+job_worker(void *arg)
+{
+	struct job_queue *q = arg;
+	struct ea_arena arena;
+	struct job *job;
+	FILE *out;
+	char *buf;
+	size_t len;
+	int ret;
 
-	if (flags & F_APPEND_NULL_ALL || flags & F_APPEND_NULL) {
-		get_append_list(&xlist, &append_list, attr);
-		if ((setret = fix_append_list(fd, path, flags, &append_list)) < 0) {
-			ret = EX_DATAERR;
-			goto cleanup;
-		}
-		ret = setret;
-	}
+	memset(&arena, 0, sizeof(arena));
 
-cleanup:
-	unlink_afp_list(&afp_list);
-	unlink_append_list(&append_list);
-	free_extended_attributes(&xlist);
-	if (fd > 0)
-		close(fd);
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (q->next == q->head && !q->done)
+			pthread_cond_wait(&q->work, &q->lock);
+		if (q->next == q->head)
+			break;
 
-	return (ret);
-}
+		/* slots do not move until they are printed, so job stays ours */
+		job = &q->jobs[q->next % JOB_QUEUE_SIZE];
+		job->state = JOB_RUNNING;
+		q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		/* only -v, -d and -R print anything, don't bother otherwise */
+		buf = NULL;
+		len = 0;
+		out = NULL;
+		if ((q->flags & (EA_VERBOSE|EA_DEBUG|EA_REPORT)) &&
+			(out = open_memstream(&buf, &len)) == NULL)
+			err(EX_OSERR, "open_memstream");
+
+		ret = do_ea_stuff_single(job->path, q->attr, q->flags,
+			&arena, out);
+		if (out != NULL)
+			fclose(out);
+
+		pthread_mutex_lock(&q->lock);
+		job->ret = ret;
+		job->out = buf;
+		job->outlen = len;
+		job->state = JOB_DONE;
+		print_jobs(q);
+	}
+	pthread_mutex_unlock(&q->lock);
 
-static int
-fts_compare(const FTSENT * const *s1, const FTSENT * const *s2)
-{
-	return (strcoll((*s1)->fts_name, (*s2)->fts_name));
+	ea_arena_free(&arena);
+	return (NULL);
 }
 
 static int
-do_ea_stuff_recursive(char **paths, const char *attr, u_int64_t flags)
+do_ea_stuff_recursive(char **paths, const char *attr, u_int64_t flags,
+	int nthreads, struct checkpoint *ck)
 {
-	int rval = 0;
+	int i, error, finished, rval = 0;
+	size_t rootlen = 0;
 	FTS *tree;
 	FTSENT *entry;
+	struct ea_arena arena;
+	struct job_queue *q = NULL;
+	pthread_t *threads = NULL;
 
 	if ((tree = fts_open(paths, FTS_LOGICAL | FTS_NOSTAT, fts_compare)) == NULL) {
 		warn("fts_open");
 		return (EX_OSERR);
 	}
 
-	for (rval = 0;(entry = fts_read(tree)) != NULL;) {
+	memset(&arena, 0, sizeof(arena));
+
+	/* what the run we resume found still counts */
+	if (ck != NULL)
+		rval = ck->rval;
+
+	if (nthreads > 1) {
+		if ((q = calloc(1, sizeof(*q))) == NULL ||
+			(threads = calloc(nthreads, sizeof(*threads))) == NULL)
+			err(EX_OSERR, "calloc");
+
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_cond_init(&q->space, NULL);
+		pthread_cond_init(&q->work, NULL);
+		q->attr = attr;
+		q->flags = flags;
+		q->ck = ck;
+		q->rval = rval;
+
+		for (i = 0;i < nthreads;i++) {
+			if ((error = pthread_create(&threads[i], NULL,
+				job_worker, q)) != 0)
+				errc(EX_OSERR, error, "pthread_create");
+		}
+	}
+
+	while ((entry = fts_read(tree)) != NULL) {
 		switch (entry->fts_info) {
 			case FTS_D:
 			case FTS_F:
-				rval |= do_ea_stuff_single(entry->fts_accpath, attr, flags);
+				if (entry->fts_level == FTS_ROOTLEVEL)
+					rootlen = entry->fts_pathlen;
+				if (checkpoint_done(ck, tree, entry))
+					break;
+
+				if (q != NULL) {
+					queue_job(q, entry->fts_accpath, rootlen);
+				} else {
+					rval |= do_ea_stuff_single(entry->fts_accpath,
+						attr, flags, &arena, stdout);
+					checkpoint_save(ck, entry->fts_path, rootlen, rval);
+				}
 				break;
 
 			case FTS_ERR:
@@ -437,17 +466,41 @@ do_ea_stuff_recursive(char **paths, const char *attr, u_int64_t flags)
 				break;
 		}
 	}
+	finished = (errno == 0);
+
+	if (q != NULL) {
+		pthread_mutex_lock(&q->lock);
+		q->done = 1;
+		pthread_cond_broadcast(&q->work);
+		pthread_mutex_unlock(&q->lock);
+
+		for (i = 0;i < nthreads;i++)
+			pthread_join(threads[i], NULL);
+		rval |= q->rval;
+
+		pthread_cond_destroy(&q->work);
+		pthread_cond_destroy(&q->space);
+		pthread_mutex_destroy(&q->lock);
+		free(threads);
+		free(q);
+	}
+
+	/* the walk got to its end, there is nothing left to resume */
+	if (ck != NULL && finished && unlink(ck->file) < 0 && errno != ENOENT)
+		warn("%s", ck->file);
 
 	fts_close(tree);
+	ea_arena_free(&arena);
 	return (rval);
 }
 
 int
 main(int argc, char **argv)
 {
-	int ch, setret, ret = 0;
-	char *prog, *path, *rp, *attr;
-	u_int64_t flags = F_NONE;
+	int ch, setret, ret = 0, nthreads = 1;
+	const char *errstr;
+	char *prog, *path, *rp, *attr, *ckfile = NULL;
+	u_int64_t flags = EA_NONE;
 
 	path = rp = attr = NULL;
 
@@ -455,10 +508,10 @@ main(int argc, char **argv)
 	if (argc < 2)
 		usage(prog);
 
-	while ((ch = getopt(argc, argv, "acCdfn:p:rv")) != -1) {
+	while ((ch = getopt(argc, argv, "acCdfj:k:n:p:rRv")) != -1) {
 		switch (ch) {
 			case 'a':
-				flags |= (F_APPEND_NULL_ALL | F_APPEND_NULL);
+				flags |= (EA_APPEND_NULL_ALL | EA_APPEND_NULL);
 				if (attr != NULL) {
 					free(attr);
 					attr = NULL;
@@ -466,35 +519,50 @@ main(int argc, char **argv)
 				break;
 
 			case 'c':
-				flags |= F_CHECK_AFP_EA;
-				flags &= ~F_FIX_AFP_EA;
+				flags |= EA_CHECK_AFP_EA;
+				flags &= ~EA_FIX_AFP_EA;
 				break;
 
 			case 'C':
-				flags |= F_DRY_RUN;
+				flags |= EA_DRY_RUN;
 				break;
 
 			case 'd':
-				flags |= F_DEBUG;
+				flags |= EA_DEBUG;
 				break;
 
 			case 'f':
-				flags |= F_FIX_AFP_EA;
-				flags &= ~F_CHECK_AFP_EA;
+				flags |= EA_FIX_AFP_EA;
+				flags &= ~EA_CHECK_AFP_EA;
+				break;
+
+			case 'j':
+				nthreads = strtonum(optarg, 1, MAX_THREADS, &errstr);
+				if (errstr != NULL)
+					errx(EX_USAGE, "number of threads is %s: %s",
+						errstr, optarg);
+				break;
+
+			case 'k':
+				ckfile = optarg;
 				break;
 
 			case 'n':
 				attr = strdup(optarg);
-				flags |= F_APPEND_NULL;
-				flags &= ~F_APPEND_NULL_ALL;
+				flags |= EA_APPEND_NULL;
+				flags &= ~EA_APPEND_NULL_ALL;
 				break;
 
 			case 'r':
 				flags |= F_RECURSIVE;
 				break;
 
+			case 'R':
+				flags |= EA_REPORT;
+				break;
+
 			case 'v':
-				flags |= F_VERBOSE;
+				flags |= EA_VERBOSE;
 				break;
 
 			default:
@@ -505,6 +573,9 @@ main(int argc, char **argv)
 	argc -= optind;		
 	argv += optind;
 
+	if (ckfile != NULL && !(flags & F_RECURSIVE))
+		errx(EX_USAGE, "-k only makes sense with -r");
+
 	if (!isatty(STDIN_FILENO)) {
 		ssize_t nread;
 		static char pathbuf[PATH_MAX];
@@ -542,10 +613,22 @@ main(int argc, char **argv)
 			goto out;
 		}
 
-		ret = do_ea_stuff_recursive(argv, attr, flags);
+		if (ckfile != NULL) {
+			struct checkpoint ck;
+
+			checkpoint_open(&ck, ckfile);
+			ret = do_ea_stuff_recursive(argv, attr, flags, nthreads, &ck);
+			checkpoint_close(&ck);
+		} else {
+			ret = do_ea_stuff_recursive(argv, attr, flags, nthreads, NULL);
+		}
 
 	} else {
-		ret = do_ea_stuff_single(rp, attr, flags);
+		struct ea_arena arena;
+
+		memset(&arena, 0, sizeof(arena));
+		ret = do_ea_stuff_single(rp, attr, flags, &arena, stdout);
+		ea_arena_free(&arena);
 	}
 
 out:
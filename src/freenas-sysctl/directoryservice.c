@@ -36,50 +36,42 @@
 
 #include "directoryservice.h"
 
-static struct {
 #define DSSTRSIZE	1024
 
+static const struct service_knob activedirectory_knobs[] = {
+	{ "dns", "lifetime", CTLTYPE_ULONG, 5, NULL, "DNS lifetime" },
+	{ "dns", "timeout", CTLTYPE_ULONG, 5, NULL, "DNS timeout" },
+	{ NULL, "cache", CTLTYPE_ULONG, 0, NULL, "Cache users and groups" },
+	{ NULL, "enumerate", CTLTYPE_ULONG, 0, NULL, "Enumerate users and groups" },
+	{ NULL }
+};
+
+static const struct service_knob ds_knobs[] = {
+	{ NULL, "cache", CTLTYPE_ULONG, 0, NULL, "Cache users and groups" },
+	{ NULL, "enumerate", CTLTYPE_ULONG, 0, NULL, "Enumerate users and groups" },
+	{ NULL }
+};
+
+static const struct service_desc directoryservices[] = {
+	{ "activedirectory", { 90, 90, 90, 180, 180 },
+		SERVICE_ERROR | SERVICE_LOOKUPS, activedirectory_knobs },
+	{ "ldap", { .start = 90, .stop = 90, .restart = 180, .reload = 180 },
+		SERVICE_ERROR | SERVICE_LOOKUPS, ds_knobs },
+	{ "nis", { 0 }, SERVICE_LOOKUPS, ds_knobs },
+	{ "kerberos", { 0 }, SERVICE_ERROR, NULL }
+};
+
+static struct {
 	struct service_timeout ds_st;
 	struct service_error ds_se;
-
-	struct {
-		struct service_timeout ds_st;
-		struct service_error ds_se;
-		struct {
-			unsigned long lifetime;
-			unsigned long timeout;
-		} dns;
-		unsigned long cache;
-		unsigned long enumerate;
-	} activedirectory;
-
-	struct {
-		struct service_timeout ds_st;
-		struct service_error ds_se;
-		unsigned long cache;
-		unsigned long enumerate;
-	} ldap;
-
-	struct nis {
-		struct service_timeout ds_st;
-		struct service_error ds_se;
-		unsigned long cache;
-		unsigned long enumerate;
-	} nis;
-
-	struct kerberos {
-		struct service_timeout ds_st;
-		struct service_error ds_se;
-	} kerberos;
-	
+	struct service_node ds_sn[nitems(directoryservices)];
 } *g_directoryservice;
 
 static int
 directoryservice_init(void)
 {
-	struct sysctl_oid *dstree, *tmptree, *tmptree2;
-
-	/* TODO: break into functions for each tree */
+	struct sysctl_oid *dstree;
+	u_int i;
 
 	/* Directory service memory allocations */
 	g_directoryservice = malloc(sizeof(*g_directoryservice),
@@ -88,22 +80,6 @@ directoryservice_init(void)
 		malloc(DSSTRSIZE, M_FREENAS_SYSCTL, M_ZERO | M_WAITOK);
 	g_directoryservice->ds_se.last_error.size = DSSTRSIZE;
 
-	/* Active Directory memory allocations */
-	g_directoryservice->activedirectory.ds_se.last_error.value = \
-		malloc(DSSTRSIZE, M_FREENAS_SYSCTL, M_ZERO | M_WAITOK);
-	g_directoryservice->activedirectory.ds_se.last_error.size = DSSTRSIZE;
-
-	/* LDAP memory allocations */
-	g_directoryservice->ldap.ds_se.last_error.value = \
-		malloc(DSSTRSIZE, M_FREENAS_SYSCTL, M_ZERO | M_WAITOK);
-	g_directoryservice->ldap.ds_se.last_error.size = DSSTRSIZE;
-
-	/* Kerberos memory allocations */
-	g_directoryservice->kerberos.ds_se.last_error.value = \
-		malloc(DSSTRSIZE, M_FREENAS_SYSCTL, M_ZERO | M_WAITOK);
-	g_directoryservice->kerberos.ds_se.last_error.size = DSSTRSIZE;
-
-
 	/* Directory Service node */
 	if ((dstree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
 		SYSCTL_CHILDREN(g_freenas_sysctl_tree), OID_AUTO,
@@ -119,108 +95,14 @@ directoryservice_init(void)
 		FAILRET("Failed to add directoryservice error node.\n", -1);
 	}
 
-	/* Active Directory node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(dstree), OID_AUTO,
-		"activedirectory", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add activedirectory node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_directoryservice->activedirectory.ds_st)) != 0) {
-		FAILRET("Failed to add activedirectory timeout node.\n", -1);
-	}
-	if ((freenas_sysctl_add_error_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_directoryservice->activedirectory.ds_se)) != 0) {
-		FAILRET("Failed to add activedirectory error node.\n", -1);
-	}
-
-	g_directoryservice->activedirectory.ds_st.start = 90;
-	g_directoryservice->activedirectory.ds_st.stop = 90;
-	g_directoryservice->activedirectory.ds_st.started = 90;
-	g_directoryservice->activedirectory.ds_st.restart = 180;
-	g_directoryservice->activedirectory.ds_st.reload = 180;
-
-	if ((tmptree2 = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(tmptree), OID_AUTO,
-		"dns", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add directoryservice DNS node.\n", -1);
-	}
-	SYSCTL_ADD_ULONG(&g_freenas_sysctl_ctx, SYSCTL_CHILDREN(tmptree2), OID_AUTO,
-		"lifetime", CTLFLAG_RW, &g_directoryservice->activedirectory.dns.lifetime, "DNS lifetime");
-	SYSCTL_ADD_ULONG(&g_freenas_sysctl_ctx, SYSCTL_CHILDREN(tmptree2), OID_AUTO,
-		"timeout", CTLFLAG_RW,  &g_directoryservice->activedirectory.dns.timeout, "DNS timeout");
-
-	g_directoryservice->activedirectory.dns.timeout = 5;
-	g_directoryservice->activedirectory.dns.lifetime = 5;
-
-	SYSCTL_ADD_ULONG(&g_freenas_sysctl_ctx, SYSCTL_CHILDREN(tmptree), OID_AUTO,
-		"cache", CTLFLAG_RW,  &g_directoryservice->activedirectory.cache, "Cache users and groups");
-	SYSCTL_ADD_ULONG(&g_freenas_sysctl_ctx, SYSCTL_CHILDREN(tmptree), OID_AUTO,
-		"enumerate", CTLFLAG_RW,  &g_directoryservice->activedirectory.enumerate, "Enumerate users and groups");
-
-	g_directoryservice->activedirectory.cache = 0;
-	g_directoryservice->activedirectory.enumerate = 0;
-
-	/* LDAP node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(dstree), OID_AUTO,
-		"ldap", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add ldap node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_directoryservice->ldap.ds_st)) != 0) {
-		FAILRET("Failed to add ldap timeout node.\n", -1);
-	}
-	if ((freenas_sysctl_add_error_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_directoryservice->ldap.ds_se)) != 0) {
-		FAILRET("Failed to add ldap error node.\n", -1);
-	}
-
-	g_directoryservice->ldap.ds_st.start = 90;
-	g_directoryservice->ldap.ds_st.stop = 90;
-	g_directoryservice->ldap.ds_st.restart = 180;
-	g_directoryservice->ldap.ds_st.reload = 180;
-
-	SYSCTL_ADD_ULONG(&g_freenas_sysctl_ctx, SYSCTL_CHILDREN(tmptree), OID_AUTO,
-		"cache", CTLFLAG_RW,  &g_directoryservice->ldap.cache, "Cache users and groups");
-	SYSCTL_ADD_ULONG(&g_freenas_sysctl_ctx, SYSCTL_CHILDREN(tmptree), OID_AUTO,
-		"enumerate", CTLFLAG_RW,  &g_directoryservice->ldap.enumerate, "Enumerate users and groups");
-
-	g_directoryservice->ldap.cache = 0;
-	g_directoryservice->ldap.enumerate = 0;
-
-	/* NIS node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(dstree), OID_AUTO,
-		"nis", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add nis node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_directoryservice->nis.ds_st)) != 0) {
-		FAILRET("Failed to add nis timeout node.\n", -1);
-	}
-
-	SYSCTL_ADD_ULONG(&g_freenas_sysctl_ctx, SYSCTL_CHILDREN(tmptree), OID_AUTO,
-		"cache", CTLFLAG_RW,  &g_directoryservice->nis.cache, "Cache users and groups");
-	SYSCTL_ADD_ULONG(&g_freenas_sysctl_ctx, SYSCTL_CHILDREN(tmptree), OID_AUTO,
-		"enumerate", CTLFLAG_RW,  &g_directoryservice->nis.enumerate, "Enumerate users and groups");
-
-	g_directoryservice->nis.cache = 0;
-	g_directoryservice->nis.enumerate = 0;
-
-	/* Kerberos node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(dstree), OID_AUTO,
-		"kerberos", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add kerberos node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_directoryservice->kerberos.ds_st)) != 0) {
-		FAILRET("Failed to add kerberos timeout node.\n", -1);
-	}
-	if ((freenas_sysctl_add_error_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_directoryservice->kerberos.ds_se)) != 0) {
-		FAILRET("Failed to add kerberos error node.\n", -1);
+	for (i = 0;i < nitems(directoryservices);i++) {
+		if (freenas_sysctl_add_service(&g_freenas_sysctl_ctx,
+			dstree, &directoryservices[i],
+			&g_directoryservice->ds_sn[i]) != 0) {
+			printf("%s: Failed to add %s node.\n", __FUNCTION__,
+				directoryservices[i].name);
+			return (-1);
+		}
 	}
 
 	return (0);
@@ -229,12 +111,12 @@ directoryservice_init(void)
 static int
 directoryservice_fini(void)
 {
-	free(g_directoryservice->kerberos.ds_se.last_error.value,
-		M_FREENAS_SYSCTL);
-	free(g_directoryservice->ldap.ds_se.last_error.value,
-		M_FREENAS_SYSCTL);
-	free(g_directoryservice->activedirectory.ds_se.last_error.value,
-		M_FREENAS_SYSCTL);
+	u_int i;
+
+	for (i = 0;i < nitems(directoryservices);i++) {
+		freenas_sysctl_free_service(&directoryservices[i],
+			&g_directoryservice->ds_sn[i]);
+	}
 	free(g_directoryservice->ds_se.last_error.value,
 		M_FREENAS_SYSCTL);
 	free(g_directoryservice, M_FREENAS_SYSCTL);
@@ -38,7 +38,9 @@
 #include <sys/param.h>
 #include <sys/module.h>
 #include <sys/kernel.h>
+#include <sys/proc.h>
 #include <sys/queue.h>
+#include <sys/sbuf.h>
 #include <sys/systm.h>
 #include <sys/sysctl.h>
 
@@ -63,6 +65,9 @@
 #define	FREENAS_VERSION	"FreeNAS-11-MASTER"
 #define	MODULE_NAME	"freenas_sysctl"
 
+/* Largest value of a single leaf freenas.snapshot takes */
+#define	SNAPSHOT_VALUE_MAX	4096
+
 MALLOC_DEFINE(M_FREENAS_SYSCTL,
 	"freenas_sysctl", "FreeNAS sysctl configuration");
 
@@ -125,6 +130,141 @@ freenas_sysctl_remove_module(struct freenas_sysctl_module *m)
 }
 
 
+/* What SYSCTL_OUT() does for a kernel request, into snapshot_leaf()'s buffer */
+static int
+snapshot_old(struct sysctl_req *req, const void *p, size_t l)
+{
+	size_t i = 0;
+
+	if (req->oldidx < req->oldlen)
+		i = MIN(l, req->oldlen - req->oldidx);
+	if (i > 0)
+		bcopy(p, (char *)req->oldptr + req->oldidx, i);
+	req->oldidx += l;
+	if (i != l)
+		return (ENOMEM);
+
+	return (0);
+}
+
+static int
+snapshot_new(struct sysctl_req *req, void *p, size_t l)
+{
+	return (EPERM);
+}
+
+/* The name of oid, relative to the freenas root node */
+static int
+snapshot_name(struct sysctl_oid *oid, char *name, size_t size)
+{
+	const char *parts[CTL_MAXNAME];
+	int i, n = 0;
+
+	for (;oid != NULL && oid != g_freenas_sysctl_tree;oid = SYSCTL_PARENT(oid)) {
+		if (n == CTL_MAXNAME)
+			return (-1);
+		parts[n++] = oid->oid_name;
+	}
+	if (oid == NULL)
+		return (-1);
+
+	name[0] = '\0';
+	for (i = n - 1;i >= 0;i--) {
+		if (i != n - 1)
+			strlcat(name, ".", size);
+		if (strlcat(name, parts[i], size) >= size)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Read one leaf the way sysctl(3) would, through its own handler, and
+ * append it to the snapshot.
+ */
+static int
+snapshot_leaf(struct sbuf *sb, struct sysctl_oid *oid, char *value)
+{
+	struct freenas_snapshot_entry fse;
+	struct sysctl_req req;
+	const char *fmt;
+	char name[FNBUFSIZ_256];
+
+	if (snapshot_name(oid, name, sizeof(name)) != 0)
+		return (-1);
+
+	bzero(&req, sizeof(req));
+	req.td = curthread;
+	req.lock = REQ_UNWIRED;
+	req.oldptr = value;
+	req.oldlen = req.validlen = SNAPSHOT_VALUE_MAX;
+	req.oldfunc = snapshot_old;
+	req.newfunc = snapshot_new;
+	if (oid->oid_handler(oid, oid->oid_arg1, oid->oid_arg2, &req) != 0)
+		return (-1);
+
+	fmt = oid->oid_fmt != NULL ? oid->oid_fmt : "";
+	fse.namelen = strlen(name);
+	fse.type = oid->oid_kind & CTLTYPE;
+	fse.fmtlen = strlen(fmt);
+	fse.valuelen = req.oldidx;
+
+	sbuf_bcat(sb, &fse, sizeof(fse));
+	sbuf_bcat(sb, name, fse.namelen);
+	sbuf_bcat(sb, fmt, fse.fmtlen);
+	sbuf_bcat(sb, value, fse.valuelen);
+
+	return (0);
+}
+
+/*
+ * freenas.snapshot, so that middlewared does not have to read the tree
+ * one leaf at a time. Leaves that fail to read, or are larger than
+ * SNAPSHOT_VALUE_MAX, are left out.
+ */
+static int
+sysctl_freenas_snapshot(SYSCTL_HANDLER_ARGS)
+{
+	struct freenas_snapshot_header fsh;
+	struct freenas_snapshot_entry end;
+	struct sysctl_ctx_entry *e;
+	struct sysctl_oid *oid;
+	struct sbuf *sb;
+	char *value;
+	int error;
+
+	error = sysctl_wire_old_buffer(req, 0);
+	if (error != 0)
+		return (error);
+
+	value = malloc(SNAPSHOT_VALUE_MAX, M_FREENAS_SYSCTL, M_WAITOK);
+	sb = sbuf_new_for_sysctl(NULL, NULL, FNBUFSIZ, req);
+
+	fsh.magic = FREENAS_SNAPSHOT_MAGIC;
+	fsh.version = FREENAS_SNAPSHOT_VERSION;
+	sbuf_bcat(sb, &fsh, sizeof(fsh));
+
+	/* The context has the oids newest first */
+	TAILQ_FOREACH_REVERSE(e, &g_freenas_sysctl_ctx, sysctl_ctx_list, link) {
+		oid = e->entry;
+		if ((oid->oid_kind & CTLTYPE) == CTLTYPE_NODE ||
+			(oid->oid_kind & CTLFLAG_RD) == 0 ||
+			(oid->oid_kind & CTLFLAG_SKIP) != 0 || oid == oidp)
+			continue;
+		snapshot_leaf(sb, oid, value);
+	}
+
+	bzero(&end, sizeof(end));
+	sbuf_bcat(sb, &end, sizeof(end));
+
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	free(value, M_FREENAS_SYSCTL);
+
+	return (error);
+}
+
 static void
 freenas_sysctl_setup(void)
 {
@@ -209,20 +349,35 @@ freenas_sysctl_modevent(module_t mod, int type, void *data)
 			}
 
 			if (freenas_sysctl_init() != 0) {
+				sysctl_ctx_free(&g_freenas_sysctl_ctx);
 				freenas_sysctl_fini();
+				return (EINVAL);
+			}
+
+			if (SYSCTL_ADD_PROC(&g_freenas_sysctl_ctx,
+				SYSCTL_CHILDREN(g_freenas_sysctl_tree), OID_AUTO,
+				"snapshot", CTLTYPE_OPAQUE|CTLFLAG_RD, NULL, 0,
+				sysctl_freenas_snapshot, "S,freenas_snapshot",
+				"the whole freenas tree in one read") == NULL) {
+				printf("%s: failed to add snapshot node.\n", MODULE_NAME);
 				sysctl_ctx_free(&g_freenas_sysctl_ctx);
+				freenas_sysctl_fini();
 				return (EINVAL);
 			}
 
 			break;
 
 		case MOD_UNLOAD:
-			freenas_sysctl_fini();
+			/*
+			 * The counters and strings the oids point at can only
+			 * go once nobody can read them any more.
+			 */
 			if (sysctl_ctx_free(&g_freenas_sysctl_ctx) != 0) {
 				printf("%s: sysctl_ctx_free failed.\n", MODULE_NAME);
 				return (ENOTEMPTY);
 			}
 
+			freenas_sysctl_fini();
 			freenas_sysctl_teardown();
 			break;
 
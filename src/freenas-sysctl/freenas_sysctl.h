@@ -28,6 +28,7 @@
 #define	__FREENAS_SYSCTL_H
 
 #include <sys/param.h>
+#include <sys/counter.h>
 #include <sys/malloc.h>
 #include <sys/kernel.h>
 #include <sys/sbuf.h>
@@ -69,6 +70,141 @@ struct service_error {
 	struct fstring last_error;
 };
 
+/*
+ * Runtime counters for a service, bumped from userland by writing to
+ * freenas.services.<svc>.event and read back all at once through
+ * freenas.services.<svc>.stats. They are counter(9)s, so bumping one
+ * is a per-CPU add without any locking. Start and stop latencies go
+ * into power of two buckets of milliseconds: bucket 0 is under 1ms,
+ * bucket n is [2^(n-1), 2^n) and the last one is everything longer.
+ */
+#define	SERVICE_STATS_VERSION	1
+#define	SERVICE_STATS_BUCKETS	16
+
+enum {
+	SERVICE_EVENT_START = 0,
+	SERVICE_EVENT_STOP = 1,
+	SERVICE_EVENT_RESTART = 2,
+	SERVICE_EVENT_RELOAD = 3,
+	SERVICE_EVENT_FAIL = 4,
+	SERVICE_EVENT_COUNT = 5
+};
+
+struct service_stats {
+	counter_u64_t events[SERVICE_EVENT_COUNT];
+	counter_u64_t start_latency[SERVICE_STATS_BUCKETS];
+	counter_u64_t stop_latency[SERVICE_STATS_BUCKETS];
+	volatile u_long last_transition;
+};
+
+/* What reading freenas.services.<svc>.stats returns */
+struct service_stats_export {
+	uint64_t version;
+	uint64_t events[SERVICE_EVENT_COUNT];
+	uint64_t last_transition;
+	uint64_t start_latency[SERVICE_STATS_BUCKETS];
+	uint64_t stop_latency[SERVICE_STATS_BUCKETS];
+};
+
+/*
+ * Identity lookup counters for a directory service, under
+ * freenas.directoryservice.<ds>.stats. Resolvers count lookups on their
+ * own and write what they have seen since last time to stats.update as
+ * a struct lookup_stats_update, so that a whole batch of lookups costs a
+ * single sysctl. Latencies go into power of two buckets of microseconds,
+ * bucket 0 is under 1us, bucket n is [2^(n-1), 2^n) and the last one is
+ * everything longer, and the percentiles are read back in microseconds
+ * as the upper end of the bucket they fall in.
+ */
+#define	LOOKUP_STATS_VERSION	1
+#define	LOOKUP_STATS_BUCKETS	24
+
+struct lookup_stats {
+	counter_u64_t hits;
+	counter_u64_t misses;
+	counter_u64_t dns_timeouts;
+	counter_u64_t latency[LOOKUP_STATS_BUCKETS];
+};
+
+/* What a write to freenas.directoryservice.<ds>.stats.update takes */
+struct lookup_stats_update {
+	uint64_t version;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t dns_timeouts;
+	uint64_t latency[LOOKUP_STATS_BUCKETS];
+};
+
+/*
+ * A service or directory service, for freenas_sysctl_add_service() to
+ * register from a table instead of by hand: a node with a timeout tree,
+ * timeouts other than the default 60 seconds where given, the error tree,
+ * runtime counters and lookup stats if asked for, and knobs of its own.
+ */
+#define	SERVICE_ERROR		0x01	/* has an error tree */
+#define	SERVICE_STATS		0x02	/* has event and stats leaves */
+#define	SERVICE_LOOKUPS		0x04	/* has identity lookup stats */
+
+#define	SERVICE_KNOBS_MAX	8
+#define	SERVICE_ERROR_SIZE	FNBUFSIZ_1024
+
+struct service_knob {
+	const char *node;		/* under the service's node, or NULL */
+	const char *name;
+	int type;			/* CTLTYPE_ULONG, CTLTYPE_UINT or CTLTYPE_STRING */
+	unsigned long value;		/* default */
+	int (*handler)(SYSCTL_HANDLER_ARGS);	/* for CTLTYPE_STRING, on an int */
+	const char *descr;
+};
+
+struct service_desc {
+	const char *name;
+	struct service_timeout timeout;
+	int flags;
+	const struct service_knob *knobs;	/* ends with a NULL name */
+};
+
+union service_value {
+	unsigned long ul;
+	unsigned int ui;
+	int i;
+};
+
+struct service_node {
+	struct service_timeout st;
+	struct service_error se;
+	struct service_stats ss;
+	struct lookup_stats ls;
+	union service_value knobs[SERVICE_KNOBS_MAX];
+};
+
+/*
+ * freenas.snapshot, every readable leaf under freenas in one read:
+ *
+ *	struct freenas_snapshot_header
+ *	struct freenas_snapshot_entry, name, format, value	(each leaf)
+ *	struct freenas_snapshot_entry of all zeroes
+ *
+ * in host byte order, without any padding or NUL terminators in between.
+ * The name is relative to freenas (eg. "services.smb.timeout.start"), the
+ * format is the leaf's sysctl format (eg. "LU" or "A") and the value is
+ * what reading the leaf on its own returns.
+ */
+#define	FREENAS_SNAPSHOT_MAGIC		0x53534e46	/* "FNSS" on amd64 */
+#define	FREENAS_SNAPSHOT_VERSION	1
+
+struct freenas_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct freenas_snapshot_entry {
+	uint16_t namelen;
+	uint8_t type;
+	uint8_t fmtlen;
+	uint32_t valuelen;
+};
+
 extern struct sysctl_ctx_list g_freenas_sysctl_ctx;
 extern struct sysctl_oid *g_freenas_sysctl_tree;
 
@@ -37,80 +37,6 @@
 
 #include "services.h"
 
-static struct {
-	struct service_timeout s_st;
-
-	struct {
-		struct service_timeout s_st;
-	} afp;
-
-	struct {
-		struct service_timeout s_st;
-	} dc;
-
-	struct {
-		struct service_timeout s_st;
-	} ftp;
-
-	struct {
-		struct service_timeout s_st;
-	} iscsi;
-
-	struct {
-		struct service_timeout s_st;
-	} lldp;
-
-	struct {
-		struct service_timeout s_st;
-	} nfs;
-
-	struct {
-		struct service_timeout s_st;
-	} rsync;
-
-	struct {
-		struct service_timeout s_st;
-	} s3;
-
-	struct {
-		struct service_timeout s_st;
-	} smart;
-
-	/*
-	 * This should get its own file. We should add lots more
-	 * performance tuning options here as well. Coming soon?
-	 */
-	struct {
-		struct service_timeout s_st;
-		struct {
-			unsigned int server_min_protocol;
-			unsigned int server_max_protocol;
-			unsigned int server_multi_channel;
-		} config;
-	} smb;
-
-	struct {
-		struct service_timeout s_st;
-	} snmp;
-
-	struct {
-		struct service_timeout s_st;
-	} ssh;
-
-	struct {
-		struct service_timeout s_st;
-	} tftp;
-
-	struct {
-		struct service_timeout s_st;
-	} ups;
-
-	struct {
-		struct service_timeout s_st;
-	} webdav;
-
-} *g_services;
-
 enum {
 	CORE = 0,
 	COREPLUS = 1,
@@ -196,10 +122,49 @@ sysctl_smb_server_proto(SYSCTL_HANDLER_ARGS)
 	return (error);
 }
 
+/*
+ * This should get its own file. We should add lots more performance
+ * tuning options here as well, each one is a line in a knob table like
+ * this, for the service it belongs to.
+ */
+static const struct service_knob smb_knobs[] = {
+	{ "config", "server_min_protocol", CTLTYPE_STRING, SMB2_02,
+		sysctl_smb_server_proto, "server min protocol" },
+	{ "config", "server_max_protocol", CTLTYPE_STRING, SMB3,
+		sysctl_smb_server_proto, "server max protocol" },
+	{ "config", "server_multi_channel", CTLTYPE_UINT, 0,
+		NULL, "server multi channel support" },
+	{ NULL }
+};
+
+static const struct service_desc services[] = {
+	{ "afp", { 0 }, SERVICE_STATS, NULL },
+	{ "domaincontroller", { .restart = 180 }, SERVICE_STATS, NULL },
+	{ "ftp", { 0 }, SERVICE_STATS, NULL },
+	{ "iscsi", { 0 }, SERVICE_STATS, NULL },
+	{ "lldp", { 0 }, SERVICE_STATS, NULL },
+	{ "nfs", { 0 }, SERVICE_STATS, NULL },
+	{ "rsync", { 0 }, SERVICE_STATS, NULL },
+	{ "s3", { 0 }, SERVICE_STATS, NULL },
+	{ "smart", { 0 }, SERVICE_STATS, NULL },
+	{ "smb", { 0 }, SERVICE_STATS, smb_knobs },
+	{ "snmp", { 0 }, SERVICE_STATS, NULL },
+	{ "ssh", { 0 }, SERVICE_STATS, NULL },
+	{ "tftp", { 0 }, SERVICE_STATS, NULL },
+	{ "ups", { 0 }, SERVICE_STATS, NULL },
+	{ "webdav", { 0 }, SERVICE_STATS, NULL }
+};
+
+static struct {
+	struct service_timeout s_st;
+	struct service_node s_sn[nitems(services)];
+} *g_services;
+
 static int
 services_init(void)
 {
-	struct sysctl_oid *stree, *tmptree, *tmptree2;
+	struct sysctl_oid *stree;
+	u_int i;
 
 	g_services = malloc(sizeof(*g_services),
 		M_FREENAS_SYSCTL, M_ZERO | M_WAITOK);
@@ -215,200 +180,13 @@ services_init(void)
 		FAILRET("Failed to add services timeout node.\n", -1);
 	}
 
-	/* AFP node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"afp", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add afp node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->afp.s_st)) != 0) {
-		FAILRET("Failed to add afp timeout node.\n", -1);
-	}
-
-	/* Domain Controller node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"domaincontroller", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add domain controller node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->dc.s_st)) != 0) {
-		FAILRET("Failed to add domain controller timeout node.\n", -1);
-	}
-
-	g_services->dc.s_st.restart = 180;
-
-	/* FTP node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"ftp", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add ftp node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->ftp.s_st)) != 0) {
-		FAILRET("Failed to add ftp timeout node.\n", -1);
-	}
-
-	/* iSCSI node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"iscsi", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add iscsi node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->iscsi.s_st)) != 0) {
-		FAILRET("Failed to add iscsi timeout node.\n", -1);
-	}
-
-	/* LLDP node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"lldp", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add lldp node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->lldp.s_st)) != 0) {
-		FAILRET("Failed to add lldp timeout node.\n", -1);
-	}
-
-	/* NFS node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"nfs", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add nfs node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->nfs.s_st)) != 0) {
-		FAILRET("Failed to add nfs timeout node.\n", -1);
-	}
-
-	/* Rsync node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"rsync", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add rsync node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->rsync.s_st)) != 0) {
-		FAILRET("Failed to add rsync timeout node.\n", -1);
-	}
-
-	/* S3 node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"s3", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add s3 node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->s3.s_st)) != 0) {
-		FAILRET("Failed to add s3 timeout node.\n", -1);
-	}
-
-	/* S.M.A.R.T. node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"smart", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add smart node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->smart.s_st)) != 0) {
-		FAILRET("Failed to add smart timeout node.\n", -1);
-	}
-
-	/* SMB node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"smb", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add smb node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->smb.s_st)) != 0) {
-		FAILRET("Failed to add smb timeout node.\n", -1);
-	}
-
-	g_services->smb.config.server_min_protocol = SMB2_02;
-	g_services->smb.config.server_max_protocol = SMB3;
-	g_services->smb.config.server_multi_channel = 0;
-
-	/* SMB config */
-	if ((tmptree2 = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(tmptree), OID_AUTO,
-		"config", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add SMB config node.\n", -1);
-	}
-	
-	SYSCTL_ADD_PROC(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(tmptree2), OID_AUTO,
-		"server_min_protocol", CTLTYPE_STRING|CTLFLAG_RW,
-		&g_services->smb.config.server_min_protocol, 0,
-		sysctl_smb_server_proto, "A", "server min protocol");
-
-	SYSCTL_ADD_PROC(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(tmptree2), OID_AUTO,
-		"server_max_protocol", CTLTYPE_STRING|CTLFLAG_RW,
-		&g_services->smb.config.server_max_protocol, 0,
-		sysctl_smb_server_proto, "A", "server max protocol");
-
-	SYSCTL_ADD_UINT(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(tmptree2), OID_AUTO,
-		"server_multi_channel", CTLFLAG_RW,
-		&g_services->smb.config.server_multi_channel, 0,
-		"server multi channel support");
-
-	/* SNMP node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"snmp", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add snmp node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->snmp.s_st)) != 0) {
-		FAILRET("Failed to add snmp timeout node.\n", -1);
-	}
-
-	/* SSH node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"ssh", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add ssh node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->ssh.s_st)) != 0) {
-		FAILRET("Failed to add ssh timeout node.\n", -1);
-	}
-
-	/* TFTP node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"tftp", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add tftp node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->tftp.s_st)) != 0) {
-		FAILRET("Failed to add tftp timeout node.\n", -1);
-	}
-
-	/* UPS node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"ups", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add ups node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->ups.s_st)) != 0) {
-		FAILRET("Failed to add ups timeout node.\n", -1);
-	}
-
-	/* WebDAV node */
-	if ((tmptree = SYSCTL_ADD_NODE(&g_freenas_sysctl_ctx,
-		SYSCTL_CHILDREN(stree), OID_AUTO,
-		"webdav", CTLFLAG_RD, NULL, NULL)) == NULL) {
-		FAILRET("Failed to add webdav node.\n", -1);
-	}
-	if ((freenas_sysctl_add_timeout_tree(&g_freenas_sysctl_ctx,
-		tmptree, &g_services->webdav.s_st)) != 0) {
-		FAILRET("Failed to add webdav timeout node.\n", -1);
+	for (i = 0;i < nitems(services);i++) {
+		if (freenas_sysctl_add_service(&g_freenas_sysctl_ctx,
+			stree, &services[i], &g_services->s_sn[i]) != 0) {
+			printf("%s: Failed to add %s node.\n", __FUNCTION__,
+				services[i].name);
+			return (-1);
+		}
 	}
 
 	return (0);
@@ -417,6 +195,10 @@ services_init(void)
 static int
 services_fini(void)
 {
+	u_int i;
+
+	for (i = 0;i < nitems(services);i++)
+		freenas_sysctl_free_service(&services[i], &g_services->s_sn[i]);
 	free(g_services, M_FREENAS_SYSCTL);
 	return (0);
 }
@@ -25,11 +25,13 @@
  */
 
 #include <sys/param.h>
+#include <sys/counter.h>
 #include <sys/malloc.h>
 #include <sys/module.h>
 #include <sys/kernel.h>
 #include <sys/systm.h>
 #include <sys/sysctl.h>
+#include <sys/time.h>
 
 #include "freenas_sysctl.h"
 #include "utils.h"
@@ -82,3 +84,380 @@ freenas_sysctl_add_error_tree(struct sysctl_ctx_list *ctx,
 
 	return (0);
 }
+
+static const char *SERVICE_EVENTS[] = {
+	"start",
+	"stop",
+	"restart",
+	"reload",
+	"fail"
+};
+
+static int
+latency2bucket(u_long msec)
+{
+	if (msec == 0)
+		return (0);
+
+	return (MIN(flsl(msec), SERVICE_STATS_BUCKETS - 1));
+}
+
+static int
+sysctl_service_stats(SYSCTL_HANDLER_ARGS)
+{
+	struct service_stats *ss = oidp->oid_arg1;
+	struct service_stats_export sse;
+	int i;
+
+	bzero(&sse, sizeof(sse));
+	sse.version = SERVICE_STATS_VERSION;
+	for (i = 0;i < SERVICE_EVENT_COUNT;i++)
+		sse.events[i] = counter_u64_fetch(ss->events[i]);
+	sse.last_transition = ss->last_transition;
+	for (i = 0;i < SERVICE_STATS_BUCKETS;i++) {
+		sse.start_latency[i] = counter_u64_fetch(ss->start_latency[i]);
+		sse.stop_latency[i] = counter_u64_fetch(ss->stop_latency[i]);
+	}
+
+	return (SYSCTL_OUT(req, &sse, sizeof(sse)));
+}
+
+/*
+ * Takes "<event>" or "<event> <milliseconds>", eg. "start 1200" once a
+ * service has come up 1.2 seconds after it was asked to start.
+ */
+static int
+sysctl_service_event(SYSCTL_HANDLER_ARGS)
+{
+	struct service_stats *ss = oidp->oid_arg1;
+	char event[FNBUFSIZ_32], *ptr, *name, *end;
+	u_long msec = 0;
+	int error, i;
+
+	event[0] = '\0';
+	error = sysctl_handle_string(oidp, event, sizeof(event), req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	ptr = event;
+	name = strsep(&ptr, " ");
+	if (ptr != NULL) {
+		msec = strtoul(ptr, &end, 10);
+		if (end == ptr || *end != '\0')
+			return (EINVAL);
+	}
+
+	for (i = 0;i < SERVICE_EVENT_COUNT;i++) {
+		if (strcasecmp(name, SERVICE_EVENTS[i]) == 0)
+			break;
+	}
+	if (i == SERVICE_EVENT_COUNT)
+		return (EINVAL);
+
+	counter_u64_add(ss->events[i], 1);
+	if (i == SERVICE_EVENT_START && ptr != NULL)
+		counter_u64_add(ss->start_latency[latency2bucket(msec)], 1);
+	else if (i == SERVICE_EVENT_STOP && ptr != NULL)
+		counter_u64_add(ss->stop_latency[latency2bucket(msec)], 1);
+	if (i != SERVICE_EVENT_RELOAD)
+		atomic_store_rel_long(&ss->last_transition, time_second);
+
+	return (0);
+}
+
+int
+freenas_sysctl_add_stats_tree(struct sysctl_ctx_list *ctx,
+	struct sysctl_oid *root, struct service_stats *ss)
+{
+	int i;
+
+	for (i = 0;i < SERVICE_EVENT_COUNT;i++)
+		ss->events[i] = counter_u64_alloc(M_WAITOK);
+	for (i = 0;i < SERVICE_STATS_BUCKETS;i++) {
+		ss->start_latency[i] = counter_u64_alloc(M_WAITOK);
+		ss->stop_latency[i] = counter_u64_alloc(M_WAITOK);
+	}
+	ss->last_transition = 0;
+
+	if (SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+		"stats", CTLTYPE_OPAQUE|CTLFLAG_RD|CTLFLAG_MPSAFE, ss, 0,
+		sysctl_service_stats, "S,service_stats_export",
+		"service runtime counters") == NULL) {
+		return (-1);
+	}
+	if (SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+		"event", CTLTYPE_STRING|CTLFLAG_WR|CTLFLAG_MPSAFE, ss, 0,
+		sysctl_service_event, "A", "record a service event") == NULL) {
+		return (-1);
+	}
+
+	return (0);
+}
+
+void
+freenas_sysctl_free_stats(struct service_stats *ss)
+{
+	int i;
+
+	for (i = 0;i < SERVICE_EVENT_COUNT;i++) {
+		if (ss->events[i] != NULL)
+			counter_u64_free(ss->events[i]);
+	}
+	for (i = 0;i < SERVICE_STATS_BUCKETS;i++) {
+		if (ss->start_latency[i] != NULL)
+			counter_u64_free(ss->start_latency[i]);
+		if (ss->stop_latency[i] != NULL)
+			counter_u64_free(ss->stop_latency[i]);
+	}
+}
+
+static int
+sysctl_lookup_latency(SYSCTL_HANDLER_ARGS)
+{
+	struct lookup_stats *ls = oidp->oid_arg1;
+	uint64_t latency[LOOKUP_STATS_BUCKETS];
+	int i;
+
+	for (i = 0;i < LOOKUP_STATS_BUCKETS;i++)
+		latency[i] = counter_u64_fetch(ls->latency[i]);
+
+	return (SYSCTL_OUT(req, latency, sizeof(latency)));
+}
+
+/* arg2 is the percentile */
+static int
+sysctl_lookup_percentile(SYSCTL_HANDLER_ARGS)
+{
+	struct lookup_stats *ls = oidp->oid_arg1;
+	uint64_t latency[LOOKUP_STATS_BUCKETS];
+	uint64_t total = 0, seen = 0, usec = 0;
+	int i;
+
+	for (i = 0;i < LOOKUP_STATS_BUCKETS;i++) {
+		latency[i] = counter_u64_fetch(ls->latency[i]);
+		total += latency[i];
+	}
+
+	for (i = 0;i < LOOKUP_STATS_BUCKETS && total > 0;i++) {
+		seen += latency[i];
+		if (seen * 100 >= total * oidp->oid_arg2) {
+			usec = (uint64_t)1 << i;
+			break;
+		}
+	}
+
+	return (SYSCTL_OUT(req, &usec, sizeof(usec)));
+}
+
+static int
+sysctl_lookup_update(SYSCTL_HANDLER_ARGS)
+{
+	struct lookup_stats *ls = oidp->oid_arg1;
+	struct lookup_stats_update lsu;
+	int error, i;
+
+	if (req->newptr == NULL)
+		return (0);
+	if (req->newlen != sizeof(lsu))
+		return (EINVAL);
+
+	error = SYSCTL_IN(req, &lsu, sizeof(lsu));
+	if (error != 0)
+		return (error);
+	if (lsu.version != LOOKUP_STATS_VERSION)
+		return (EINVAL);
+
+	counter_u64_add(ls->hits, lsu.hits);
+	counter_u64_add(ls->misses, lsu.misses);
+	counter_u64_add(ls->dns_timeouts, lsu.dns_timeouts);
+	for (i = 0;i < LOOKUP_STATS_BUCKETS;i++) {
+		if (lsu.latency[i] != 0)
+			counter_u64_add(ls->latency[i], lsu.latency[i]);
+	}
+
+	return (0);
+}
+
+static int
+freenas_sysctl_add_lookup_tree(struct sysctl_ctx_list *ctx,
+	struct sysctl_oid *root, struct lookup_stats *ls)
+{
+	static const int percentiles[] = { 50, 90, 99 };
+	struct sysctl_oid *stats;
+	char name[FNBUFSIZ_8];
+	u_int i;
+
+	ls->hits = counter_u64_alloc(M_WAITOK);
+	ls->misses = counter_u64_alloc(M_WAITOK);
+	ls->dns_timeouts = counter_u64_alloc(M_WAITOK);
+	for (i = 0;i < LOOKUP_STATS_BUCKETS;i++)
+		ls->latency[i] = counter_u64_alloc(M_WAITOK);
+
+	if ((stats = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(root),
+		OID_AUTO, "stats", CTLFLAG_RD, NULL, NULL)) == NULL) {
+		return (-1);
+	}
+
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+		"hits", CTLFLAG_RD, &ls->hits, "cache hits");
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+		"misses", CTLFLAG_RD, &ls->misses, "cache misses");
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+		"dns_timeouts", CTLFLAG_RD, &ls->dns_timeouts, "DNS timeouts");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+		"latency", CTLTYPE_OPAQUE|CTLFLAG_RD|CTLFLAG_MPSAFE, ls, 0,
+		sysctl_lookup_latency, "S,lookup_latency",
+		"lookup latency histogram");
+
+	for (i = 0;i < nitems(percentiles);i++) {
+		snprintf(name, sizeof(name), "p%d", percentiles[i]);
+		SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+			name, CTLTYPE_U64|CTLFLAG_RD|CTLFLAG_MPSAFE, ls,
+			percentiles[i], sysctl_lookup_percentile, "QU",
+			"lookup latency percentile in microseconds");
+	}
+
+	if (SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(stats), OID_AUTO,
+		"update", CTLTYPE_OPAQUE|CTLFLAG_WR|CTLFLAG_MPSAFE, ls, 0,
+		sysctl_lookup_update, "S,lookup_stats_update",
+		"add a batch of lookups") == NULL) {
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+freenas_sysctl_free_lookups(struct lookup_stats *ls)
+{
+	int i;
+
+	if (ls->hits != NULL)
+		counter_u64_free(ls->hits);
+	if (ls->misses != NULL)
+		counter_u64_free(ls->misses);
+	if (ls->dns_timeouts != NULL)
+		counter_u64_free(ls->dns_timeouts);
+	for (i = 0;i < LOOKUP_STATS_BUCKETS;i++) {
+		if (ls->latency[i] != NULL)
+			counter_u64_free(ls->latency[i]);
+	}
+}
+
+static int
+freenas_sysctl_add_knobs(struct sysctl_ctx_list *ctx,
+	struct sysctl_oid *root, const struct service_knob *knobs,
+	union service_value *values)
+{
+	const struct service_knob *sk;
+	struct sysctl_oid *tree = root;
+	const char *node = NULL;
+	int i;
+
+	for (i = 0;knobs[i].name != NULL;i++) {
+		sk = &knobs[i];
+		if (i == SERVICE_KNOBS_MAX)
+			return (-1);
+
+		/* Knobs that share a node come one after the other */
+		if (sk->node == NULL) {
+			tree = root;
+		} else if (node == NULL || strcmp(node, sk->node) != 0) {
+			if ((tree = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(root),
+				OID_AUTO, sk->node, CTLFLAG_RD, NULL, NULL)) == NULL) {
+				return (-1);
+			}
+		}
+		node = sk->node;
+
+		switch (sk->type) {
+			case CTLTYPE_ULONG:
+				values[i].ul = sk->value;
+				SYSCTL_ADD_ULONG(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+					sk->name, CTLFLAG_RW, &values[i].ul, sk->descr);
+				break;
+
+			case CTLTYPE_UINT:
+				values[i].ui = sk->value;
+				SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+					sk->name, CTLFLAG_RW, &values[i].ui, 0, sk->descr);
+				break;
+
+			case CTLTYPE_STRING:
+				values[i].i = sk->value;
+				SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+					sk->name, CTLTYPE_STRING|CTLFLAG_RW, &values[i].i, 0,
+					sk->handler, "A", sk->descr);
+				break;
+
+			default:
+				return (-1);
+		}
+	}
+
+	return (0);
+}
+
+int
+freenas_sysctl_add_service(struct sysctl_ctx_list *ctx,
+	struct sysctl_oid *root, const struct service_desc *sd,
+	struct service_node *sn)
+{
+	const struct service_timeout *t = &sd->timeout;
+	struct sysctl_oid *tree;
+
+	if ((tree = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(root), OID_AUTO,
+		sd->name, CTLFLAG_RD, NULL, NULL)) == NULL) {
+		return (-1);
+	}
+
+	if (freenas_sysctl_add_timeout_tree(ctx, tree, &sn->st) != 0)
+		return (-1);
+	if (t->start != 0)
+		sn->st.start = t->start;
+	if (t->stop != 0)
+		sn->st.stop = t->stop;
+	if (t->started != 0)
+		sn->st.started = t->started;
+	if (t->restart != 0)
+		sn->st.restart = t->restart;
+	if (t->reload != 0)
+		sn->st.reload = t->reload;
+
+	if (sd->flags & SERVICE_ERROR) {
+		sn->se.last_error.value = malloc(SERVICE_ERROR_SIZE,
+			M_FREENAS_SYSCTL, M_ZERO | M_WAITOK);
+		sn->se.last_error.size = SERVICE_ERROR_SIZE;
+		if (freenas_sysctl_add_error_tree(ctx, tree, &sn->se) != 0)
+			return (-1);
+	}
+
+	if ((sd->flags & SERVICE_STATS) &&
+		freenas_sysctl_add_stats_tree(ctx, tree, &sn->ss) != 0) {
+		return (-1);
+	}
+
+	if ((sd->flags & SERVICE_LOOKUPS) &&
+		freenas_sysctl_add_lookup_tree(ctx, tree, &sn->ls) != 0) {
+		return (-1);
+	}
+
+	if (sd->knobs != NULL &&
+		freenas_sysctl_add_knobs(ctx, tree, sd->knobs, sn->knobs) != 0) {
+		return (-1);
+	}
+
+	return (0);
+}
+
+void
+freenas_sysctl_free_service(const struct service_desc *sd,
+	struct service_node *sn)
+{
+	if (sd->flags & SERVICE_STATS)
+		freenas_sysctl_free_stats(&sn->ss);
+	if (sd->flags & SERVICE_LOOKUPS)
+		freenas_sysctl_free_lookups(&sn->ls);
+	if (sn->se.last_error.value != NULL)
+		free(sn->se.last_error.value, M_FREENAS_SYSCTL);
+}
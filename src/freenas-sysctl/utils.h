@@ -40,4 +40,13 @@ int freenas_sysctl_add_timeout_tree(struct sysctl_ctx_list *,
 int freenas_sysctl_add_error_tree(struct sysctl_ctx_list *,
 	struct sysctl_oid *, struct service_error *);
 
+int freenas_sysctl_add_stats_tree(struct sysctl_ctx_list *,
+	struct sysctl_oid *, struct service_stats *);
+void freenas_sysctl_free_stats(struct service_stats *);
+
+int freenas_sysctl_add_service(struct sysctl_ctx_list *,
+	struct sysctl_oid *, const struct service_desc *, struct service_node *);
+void freenas_sysctl_free_service(const struct service_desc *,
+	struct service_node *);
+
 #endif /* __UTILS_H */
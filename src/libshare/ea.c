@@ -0,0 +1,563 @@
+/*-
+ * Copyright 2018 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/extattr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <err.h>
+#include <vis.h>
+
+#include "ea.h"
+
+#define AFP_EA_CORRUPTED(v)     (v[0] == 0 && v[1] == 'F' && v[2] == 'P')
+#define AFP_EA_PREFIX           3       /* all AFP_EA_CORRUPTED() looks at */
+
+#define DOSSTREAM               "DosStream."
+#define DOSSTREAM_LEN           (sizeof(DOSSTREAM) - 1)
+
+#define XATTR_FIXED_AFP         0x0001
+#define XATTR_FIXED_APPEND      0x0002
+
+
+struct xattr {
+	char *name;
+	char *value;
+	size_t length;
+	int partial;		/* value may go on past length */
+	int fixes;		/* XATTR_FIXED_* waiting to be written */
+	TAILQ_ENTRY(xattr) link;
+	TAILQ_ENTRY(xattr) afp_link;
+	TAILQ_ENTRY(xattr) append_link;
+};
+
+TAILQ_HEAD(xattr_list, xattr);
+
+#define	ARENA_BLOCK_SIZE	(64 * 1024)
+#define	ARENA_ALIGN		sizeof(void *)
+
+struct ea_arena_block {
+	struct ea_arena_block *next;
+	size_t size;
+	size_t used;
+};
+
+static void *
+arena_alloc(struct ea_arena *a, size_t len)
+{
+	struct ea_arena_block *b, **bp;
+	size_t size;
+	void *ptr;
+
+	len = roundup2(len, ARENA_ALIGN);
+	for (b = a->cur;b != NULL;b = b->next) {
+		if (b->size - b->used >= len)
+			break;
+	}
+
+	if (b == NULL) {
+		size = MAX(len, ARENA_BLOCK_SIZE);
+		if ((b = malloc(sizeof(*b) + size)) == NULL)
+			return (NULL);
+		b->next = NULL;
+		b->size = size;
+		b->used = 0;
+
+		for (bp = &a->blocks;*bp != NULL;bp = &(*bp)->next)
+			;
+		*bp = b;
+	}
+
+	a->cur = b;
+	ptr = (char *)(b + 1) + b->used;
+	b->used += len;
+
+	return (ptr);
+}
+
+static void
+arena_reset(struct ea_arena *a)
+{
+	struct ea_arena_block *b;
+
+	for (b = a->blocks;b != NULL;b = b->next)
+		b->used = 0;
+	a->cur = a->blocks;
+}
+
+void
+ea_arena_free(struct ea_arena *a)
+{
+	struct ea_arena_block *b, *next;
+
+	for (b = a->blocks;b != NULL;b = next) {
+		next = b->next;
+		free(b);
+	}
+	free(a->list);
+	memset(a, 0, sizeof(*a));
+}
+
+/* the whole value, and one spare byte for -a and -n to append to */
+static int
+get_value(int fd, const char *name, struct ea_arena *a, char **pvalue)
+{
+	char *value;
+	int getret;
+
+	if ((getret = extattr_get_fd(fd, EXTATTR_NAMESPACE_USER,
+		name, NULL, 0)) < 0)
+		return (-1);
+
+	if ((value = arena_alloc(a, getret + 1)) == NULL) {
+		warn("malloc");	
+		return (-1);
+	}
+
+	if ((getret = extattr_get_fd(fd, EXTATTR_NAMESPACE_USER,
+		name, value, getret)) < 0)
+		return (-1);
+
+	*pvalue = value;
+	return (getret);
+}
+
+/*
+ * -R prints "action<TAB>path<TAB>attribute" for everything done to an
+ * attribute, with tabs, newlines and backslashes in either escaped, so
+ * that there is one record per line. Otherwise -v prints message.
+ */
+static void
+report_ea(FILE *out, u_int64_t flags, const char *path, const char *name,
+	const char *action, const char *message)
+{
+	char *vpath, *vname;
+
+	if (flags & EA_REPORT) {
+		if (stravis(&vpath, path, VIS_TAB|VIS_NL|VIS_CSTYLE) < 0)
+			err(EX_OSERR, "stravis");
+		if (stravis(&vname, name, VIS_TAB|VIS_NL|VIS_CSTYLE) < 0)
+			err(EX_OSERR, "stravis");
+
+		fprintf(out, "%s\t%s\t%s\n", action, vpath, vname);
+		free(vname);
+		free(vpath);
+
+	} else if ((flags & EA_VERBOSE) && message != NULL) {
+		fprintf(out, "%s: %s %s\n", path, name, message);
+	}
+}
+
+/*
+ * With prefix set only that many bytes of the value are read, which is
+ * all the AFP check needs. A short buffer just gets the start of the
+ * value, so there is no need to ask for its size first either.
+ */
+static int
+add_extended_attribute(int fd, struct xattr_list *xlist, struct ea_arena *a,
+	const char *rawname, size_t len, size_t prefix)
+{
+	struct xattr *xptr = NULL;
+	char *name, *value;
+	int getret;
+
+	if ((name = arena_alloc(a, len + 1)) == NULL) {
+		warn("malloc");
+		return (-1);
+	}
+
+	memcpy(name, rawname, len);
+	name[len] = '\0';
+
+	if (prefix == 0) {
+		if ((getret = get_value(fd, name, a, &value)) < 0)
+			return (-1);
+
+	} else {
+		if ((value = arena_alloc(a, prefix)) == NULL) {
+			warn("malloc");	
+			return (-1);
+		}
+
+		if ((getret = extattr_get_fd(fd, EXTATTR_NAMESPACE_USER,
+			name, value, prefix)) < 0)
+			return (-1);
+	}
+
+	if ((xptr = arena_alloc(a, sizeof(*xptr))) == NULL) {
+		warn("malloc");	
+		return (-1);
+	}
+
+	memset(xptr, 0, sizeof(*xptr));
+	xptr->name = name;
+	xptr->value = value;
+	xptr->length = getret;
+	xptr->partial = (prefix > 0 && getret == prefix);
+
+	TAILQ_INSERT_TAIL(xlist, xptr, link);
+	return (0);
+}
+
+/*
+ * Only the streams Samba keeps for us are of interest, everything else in
+ * the user namespace is passed over in the raw list, before being copied
+ * or having its value read. The value of only is read whole, as are those
+ * of the others unless prefix is set.
+ */
+static int
+get_extended_attributes(int fd, struct xattr_list *xlist, struct ea_arena *a,
+	const char *only, size_t prefix)
+{
+	char *buf, *name;
+	int i, ch, target, ret;
+	size_t onlylen = (only != NULL) ? strlen(only) : 0;
+
+	if ((ret = extattr_list_fd(fd, EXTATTR_NAMESPACE_USER, NULL, 0)) < 0)
+		return (EX_OK);
+
+	if (ret > a->listsize) {
+		if ((buf = realloc(a->list, ret)) == NULL) {
+			warn("realloc");
+			return (-1);
+		}
+		a->list = buf;
+		a->listsize = ret;
+	}
+
+	buf = a->list;
+	if ((ret = extattr_list_fd(fd, EXTATTR_NAMESPACE_USER,
+		buf, a->listsize)) < 0) {
+		warn("extattr_list_fd");
+		return (-1);
+	}
+
+	for (i = 0;i < ret;i += ch + 1) {
+		ch = (unsigned char)buf[i];
+		name = &buf[i + 1];
+		if (ch < DOSSTREAM_LEN || i + 1 + ch > ret ||
+			memcmp(name, DOSSTREAM, DOSSTREAM_LEN) != 0)
+			continue;
+
+		target = (only != NULL && ch == onlylen &&
+			memcmp(name, only, ch) == 0);
+		add_extended_attribute(fd, xlist, a, name, ch,
+			target ? 0 : prefix);
+	}
+
+	return (0);
+}
+
+/*
+ * Just the one attribute, which extattr_get_fd() finds by name without
+ * us having to list anything.
+ */
+static int
+get_extended_attribute(int fd, struct xattr_list *xlist, struct ea_arena *a,
+	const char *name)
+{
+	if (strncmp(name, DOSSTREAM, DOSSTREAM_LEN) != 0)
+		return (0);
+
+	add_extended_attribute(fd, xlist, a, name, strlen(name), 0);
+	return (0);
+}
+
+static int
+get_afp_list(struct xattr_list *xlist, struct xattr_list *afp_list)
+{
+	struct xattr *xptr = NULL;
+
+	if (xlist == NULL || afp_list == NULL)
+		return (-1);
+
+	TAILQ_FOREACH(xptr, xlist, link) {
+		if (xptr->length >= 3 && AFP_EA_CORRUPTED(xptr->value))
+			TAILQ_INSERT_TAIL(afp_list, xptr, afp_link);
+	}
+
+	return (0);
+}
+
+static void
+hexdump_ea(FILE *out, const char *path, const char *name, const char *buf,
+	size_t length)
+{
+	int i;
+
+	if (path == NULL || name == NULL || buf == NULL || length == 0)
+		return;
+
+	fprintf(out, "%s: %s\n\t", path, name);
+	if (length < 8) {
+		for (i = 0;i < length;i++)
+			fprintf(out, "%02x ", (unsigned char)buf[i]);
+	} else {
+		for (i = 0;i < 4;i++)
+			fprintf(out, "%02x ", (unsigned char)buf[i]);
+		fprintf(out, "/ ");
+		for (i = length - 4;i < length;i++)
+			fprintf(out, "%02x ", (unsigned char)buf[i]);
+
+	}
+	fprintf(out, "[%zu]\n", length);
+}
+
+static int
+fix_afp_list(int fd, const char *path,
+		u_int64_t flags, struct xattr_list *afp_list, struct ea_arena *a,
+		FILE *out)
+{
+	int ret = 0;
+	struct xattr *xptr = NULL, *xtmp = NULL;
+
+	if (afp_list == NULL)
+		return (-1);
+
+	TAILQ_FOREACH(xptr, afp_list, afp_link) {
+		if (flags & EA_DEBUG)
+			hexdump_ea(out, path, xptr->name, xptr->value, xptr->length);
+
+		if (flags & EA_CHECK_AFP_EA) {
+			ret |= EX_EA_CORRUPTED;
+			report_ea(out, flags, path, xptr->name,
+				"corrupted", "is corrupted");
+		}
+
+		if (flags & EA_FIX_AFP_EA) {
+			if ((flags & EA_DRY_RUN) == 0) {
+				/* only now that it gets written back do we need it all */
+				if (xptr->partial) {
+					char *value;
+					int getret;
+
+					if ((getret = get_value(fd, xptr->name, a, &value)) < 0) {
+						warn("%s: %s", path, xptr->name);
+						ret |= EX_EA_CORRUPTED;
+						continue;
+					}
+					/* fixed, or rewritten, since: nothing left to do */
+					if (getret < 3 || !AFP_EA_CORRUPTED(value))
+						continue;
+					xptr->value = value;
+					xptr->length = getret;
+					xptr->partial = 0;
+				}
+
+				*((char *)xptr->value) = 'A';
+				xptr->fixes |= XATTR_FIXED_AFP;
+
+			} else {
+				report_ea(out, flags, path, xptr->name,
+					"would-fix", "is fixed");
+			}
+		}
+	}
+
+	return (ret);
+}
+
+static void
+unlink_afp_list(struct xattr_list *afp_list)
+{
+	if (afp_list != NULL) {
+		struct xattr *xptr = NULL, *xtmp = NULL;
+
+		TAILQ_FOREACH_SAFE(xptr, afp_list, afp_link, xtmp)
+			TAILQ_REMOVE(afp_list, xptr, afp_link);
+	}
+}
+
+static int
+get_append_list(struct xattr_list *xlist,
+		struct xattr_list *append_list, const char *attr)
+{
+	struct xattr *xptr = NULL;
+
+	if (xlist == NULL || append_list == NULL)
+		return (-1);
+
+	TAILQ_FOREACH(xptr, xlist, link) {
+		if (attr == NULL) {
+			TAILQ_INSERT_TAIL(append_list, xptr, append_link);
+
+		} else if (strcmp(xptr->name, attr) == 0) {
+			TAILQ_INSERT_TAIL(append_list, xptr, append_link);
+			break;
+		}
+	}
+
+	return (0);
+}
+
+static int
+fix_append_list(int fd, const char *path,
+		u_int64_t flags, struct xattr_list *append_list, FILE *out)
+{
+	int ret = 0;
+	struct xattr *xptr = NULL, *xtmp = NULL;
+
+	if (append_list == NULL)
+		return (-1);
+
+	TAILQ_FOREACH(xptr, append_list, append_link) {
+		if (flags & EA_DEBUG)
+			hexdump_ea(out, path, xptr->name, xptr->value, xptr->length);
+
+		if (flags & EA_APPEND_NULL) {
+			if ((flags & EA_DRY_RUN) == 0) {
+				/* get_extended_attributes() left room for it */
+				xptr->value[xptr->length++] = '\0';
+				xptr->fixes |= XATTR_FIXED_APPEND;
+
+			} else {
+				report_ea(out, flags, path, xptr->name,
+					"would-append", "null byte appended");
+			}
+		}
+	}
+
+	return (ret);
+}
+
+/*
+ * The fixes above only change the values we hold, and this writes each
+ * changed attribute back once, however many fixes it got. extattr(2) can
+ * only ever set a value whole, so an attribute getting both -f and -a, a
+ * large AFP_Resource stream being the worst of it, used to be written out
+ * twice to change two bytes.
+ */
+static int
+write_extended_attributes(int fd, const char *path, u_int64_t flags,
+	struct xattr_list *xlist, FILE *out)
+{
+	struct xattr *xptr = NULL;
+	int ret = 0;
+
+	TAILQ_FOREACH(xptr, xlist, link) {
+		if (xptr->fixes == 0)
+			continue;
+
+		if (extattr_set_fd(fd, EXTATTR_NAMESPACE_USER,
+			xptr->name, xptr->value, xptr->length) < 0) {
+			warn("extattr_set_fd");
+			report_ea(out, flags, path, xptr->name, "failed", NULL);
+			ret |= EX_EA_CORRUPTED;
+			continue;
+		}
+
+		if (xptr->fixes & XATTR_FIXED_AFP)
+			report_ea(out, flags, path, xptr->name, "fixed", "is fixed");
+		if (xptr->fixes & XATTR_FIXED_APPEND)
+			report_ea(out, flags, path, xptr->name,
+				"appended", "null byte appended");
+	}
+
+	return (ret);
+}
+
+static void
+unlink_append_list(struct xattr_list *append_list)
+{
+	if (append_list != NULL) {
+		struct xattr *xptr = NULL, *xtmp = NULL;
+
+		TAILQ_FOREACH_SAFE(xptr, append_list, append_link, xtmp)
+			TAILQ_REMOVE(append_list, xptr, append_link);
+	}
+}
+
+static void
+free_extended_attributes(struct xattr_list *xlist, struct ea_arena *a)
+{
+	if (xlist != NULL)
+		TAILQ_INIT(xlist);
+	arena_reset(a);
+}
+
+
+/* path is only used for messages, everything goes through fd */
+int
+ea_fix_fd(int fd, const char *path, const char *attr, u_int64_t flags,
+	struct ea_arena *a, FILE *out)
+{
+	int setret, ret = 0;
+	struct xattr_list xlist, afp_list, append_list;
+	const char *only = NULL;
+	size_t prefix = AFP_EA_PREFIX;
+
+	TAILQ_INIT(&xlist);
+	TAILQ_INIT(&afp_list);
+	TAILQ_INIT(&append_list);
+
+	/* appending and hexdumps need whole values, the AFP check does not */
+	if (flags & (EA_APPEND_NULL_ALL|EA_DEBUG))
+		prefix = 0;
+	if ((flags & (EA_APPEND_NULL_ALL|EA_APPEND_NULL)) == EA_APPEND_NULL)
+		only = attr;
+
+	/* -n on its own knows the one name it wants */
+	if ((flags & (EA_CHECK_AFP_EA|EA_FIX_AFP_EA)) || only == NULL)
+		setret = get_extended_attributes(fd, &xlist, a, only, prefix);
+	else
+		setret = get_extended_attribute(fd, &xlist, a, only);
+	if (setret < 0) {
+		ret = EX_DATAERR;
+		goto cleanup;
+	}
+
+	if (flags & EA_CHECK_AFP_EA || flags & EA_FIX_AFP_EA) {
+		get_afp_list(&xlist, &afp_list);
+		if ((setret = fix_afp_list(fd, path, flags, &afp_list, a, out)) < 0) {
+			ret = EX_DATAERR;
+			goto cleanup;
+		}
+		ret = setret;
+	}
+
+	if (flags & EA_APPEND_NULL_ALL || flags & EA_APPEND_NULL) {
+		get_append_list(&xlist, &append_list, attr);
+		if ((setret = fix_append_list(fd, path, flags, &append_list, out)) < 0) {
+			ret = EX_DATAERR;
+			goto cleanup;
+		}
+		ret = setret;
+	}
+
+	ret |= write_extended_attributes(fd, path, flags, &xlist, out);
+
+cleanup:
+	unlink_afp_list(&afp_list);
+	unlink_append_list(&append_list);
+	free_extended_attributes(&xlist, a);
+
+	return (ret);
+}
@@ -0,0 +1,80 @@
+/*-
+ * Copyright 2018 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef	__EA_H
+#define	__EA_H
+
+#include <sys/types.h>
+#include <stdio.h>
+
+/*
+ * The extended attribute repairs of fix_ea, for fix_ea itself and for
+ * winacl to do in the same pass as setting the ACLs.
+ */
+
+#define EX_EA_CORRUPTED         1
+
+#define EA_NONE                 0x0000
+#define EA_APPEND_NULL_ALL      0x0001
+#define EA_CHECK_AFP_EA         0x0002
+#define EA_DRY_RUN              0x0004
+#define EA_FIX_AFP_EA           0x0008
+#define EA_APPEND_NULL          0x0010
+#define EA_VERBOSE              0x0020
+#define EA_DEBUG                0x0040
+#define EA_REPORT               0x0100
+
+/*
+ * Everything we keep about the extended attributes of one file comes out
+ * of an arena that is reset before the next file, so that a scan of
+ * millions of files does not keep going back to malloc() for every name,
+ * value and list node. Blocks are kept across resets, as is the buffer
+ * extattr_list_fd() fills, which only ever grows to the largest list seen.
+ */
+struct ea_arena_block;
+
+struct ea_arena {
+	struct ea_arena_block *blocks;
+	struct ea_arena_block *cur;
+	char *list;
+	size_t listsize;
+};
+
+/*
+ * Check and repair the attributes of what fd is open on, as flags say.
+ * With EA_APPEND_NULL and not EA_APPEND_NULL_ALL only attr gets a null
+ * byte. out gets what EA_VERBOSE, EA_DEBUG and EA_REPORT have to say.
+ * Return EX_EA_CORRUPTED if something is or stays corrupted, and
+ * EX_DATAERR if the attributes could not be read.
+ */
+int ea_fix_fd(int, const char *, const char *, u_int64_t, struct ea_arena *,
+	FILE *);
+
+/* an arena starts out zeroed and does for any number of ea_fix_fd() calls */
+void ea_arena_free(struct ea_arena *);
+
+#endif /* __EA_H */
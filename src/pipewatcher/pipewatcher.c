@@ -4,23 +4,775 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
-#include <sys/select.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// -c and -d need liblz4 and libzstd: cc -o pipewatcher pipewatcher.c -llz4 -lzstd -lpthread
+#include <lz4.h>
+#include <zstd.h>
 
 #define BUFFER_SIZE 1048576
+#define MIN_BUFFER_SIZE 65536
+#define RELAY_SIZE (4 * 1048576)
+/* Seconds without reading or writing (~60 minutes) before we abort, see #16023 */
+#define NOOP_LIMIT 3600
+
+/* Timer idents, for reading, writing and -s */
+#define READ_TIMER 1
+#define WRITE_TIMER 2
+#define STATS_TIMER 3
+/* Workers in -c and -d mode wake up the main loop with this */
+#define WAKE_EVENT 4
+#define FLUSH_TIMER 5
+
+/* Seconds between -s lines, and microseconds of waiting that count as a stall */
+#define STATS_INTERVAL 1
+#define STALL_USEC 1000000
+
+/*
+ * -c and -d: blocks are cut at this much input, or when this many
+ * milliseconds have gone by since the first of it, and the stream starts
+ * with the magic
+ */
+#define BLOCK_SIZE 1048576
+#define FLUSH_MSEC 100
+#define BLOCK_HEADER 8
+#define STREAM_MAGIC "PWZ"
+#define STREAM_HEADER 4
+
+enum { ALG_LZ4 = 1, ALG_ZSTD = 2 };
+
+/*
+ * What has been read but not written yet. Reading goes on into the free
+ * part while the rest is being written out.
+ */
+struct ring {
+	char *buf;
+	size_t size;
+	size_t head;	/* next byte to write out */
+	size_t len;	/* bytes waiting to be written */
+	size_t high;	/* once empty, writing waits until this much is in */
+	size_t low;	/* once full, reading waits until it is down to this */
+	int write_hold;
+	int read_hold;
+};
+
+/*
+ * For -s and SIGINFO. Waiting is what pipewatcher spends with nothing to
+ * do until the sender (read) or the receiver (write) gets on with it, so
+ * the side waited on the most is the faster one, and a stall is waiting
+ * on one side for more than STALL_USEC in a row.
+ */
+struct stats {
+	FILE *fp;			/* -s, or NULL */
+	uint64_t start, last;		/* microseconds */
+	uintmax_t in, out, last_out;
+	uint64_t read_wait, write_wait;
+	unsigned int read_stalls, write_stalls;
+};
+
+/*
+ * One block for -c or -d. Blocks are used over in turn, by sequence
+ * number, and each one goes from being read into, to being worked on,
+ * to done and written out.
+ */
+struct block {
+	char *in, *out;
+	size_t in_len;		/* read so far */
+	size_t out_len;		/* made by the worker */
+	size_t out_off;		/* written out of it so far */
+	int done;		/* the worker is through with it */
+	int bad;		/* and it would not decompress */
+};
+
+struct codec {
+	int decompress;
+	int algorithm;
+	struct block *blocks;
+	unsigned int nblocks;
+	uint64_t next_read;	/* block being read into, all before it are queued */
+	uint64_t next_job;	/* block the next free worker takes */
+	uint64_t next_write;	/* block being written out */
+	char header[STREAM_HEADER];
+	size_t header_off;	/* of the stream header, read or written */
+	char trailer[BLOCK_HEADER];
+	size_t trailer_off;	/* of the end block, when compressing */
+	int eof;
+	int ended;		/* the end block came in, when decompressing */
+	int kq;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+};
+
+static struct stats stats;
+static pid_t watched_pid;
+static volatile sig_atomic_t noop_interval, stats_due, info_due;
+
+/* The free part of the ring, in up to two pieces */
+static int ring_space(struct ring *r, struct iovec *iov) {
+
+	size_t tail = (r->head + r->len) % r->size;
+
+	iov[0].iov_base = r->buf + tail;
+	if(tail >= r->head) {
+		iov[0].iov_len = r->size - tail;
+		iov[1].iov_base = r->buf;
+		iov[1].iov_len = r->head;
+	} else {
+		iov[0].iov_len = r->head - tail;
+		iov[1].iov_len = 0;
+	}
+	if(r->len == r->size)
+		iov[0].iov_len = iov[1].iov_len = 0;
+	return (iov[1].iov_len > 0 ? 2 : 1);
+}
+
+/* The used part of the ring, in up to two pieces */
+static int ring_data(struct ring *r, struct iovec *iov) {
+
+	iov[0].iov_base = r->buf + r->head;
+	if(r->head + r->len > r->size) {
+		iov[0].iov_len = r->size - r->head;
+		iov[1].iov_base = r->buf;
+		iov[1].iov_len = r->len - iov[0].iov_len;
+		return (2);
+	}
+	iov[0].iov_len = r->len;
+	return (1);
+}
+
+/* -b, in bytes with an optional k, m or g */
+static size_t parse_size(const char *arg) {
+
+	unsigned long long size;
+	char *end;
+	int shift = 0;
+
+	errno = 0;
+	size = strtoull(arg, &end, 10);
+	switch(*end) {
+	case 'k': case 'K': shift = 10; end++; break;
+	case 'm': case 'M': shift = 20; end++; break;
+	case 'g': case 'G': shift = 30; end++; break;
+	}
+	if(errno != 0 || end == arg || *end != '\0' || size > (SIZE_MAX >> shift))
+		return (0);
+	return ((size_t)size << shift);
+}
+
+static int parse_percent(const char *arg) {
+
+	char *end;
+	long percent;
+
+	percent = strtol(arg, &end, 10);
+	if(end == arg || *end != '\0' || percent < 0 || percent > 100)
+		return (-1);
+	return ((int)percent);
+}
+
+static uint64_t now_usec(void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+/*
+ * One line of tab separated totals to the -s file, the same way
+ * extract-tarball and winacl report progress:
+ *
+ *	bytes in	bytes out	MB/s	average MB/s	read wait ms	write wait ms	read stalls	write stalls
+ *
+ * MB/s covers the time since the last line only. SIGINFO gets the same
+ * on stderr, spelled out.
+ */
+static void report(FILE *fp) {
+
+	uint64_t now = now_usec();
+	double rate = 0, average = 0;
+
+	if(now > stats.last)
+		rate = (double)(stats.out - stats.last_out) / (now - stats.last);
+	if(now > stats.start)
+		average = (double)stats.out / (now - stats.start);
+	stats.last = now;
+	stats.last_out = stats.out;
+
+	if(fp == stats.fp) {
+		fprintf(fp, "%ju\t%ju\t%.1f\t%.1f\t%ju\t%ju\t%u\t%u\n",
+		    stats.in, stats.out, rate, average,
+		    (uintmax_t)stats.read_wait / 1000, (uintmax_t)stats.write_wait / 1000,
+		    stats.read_stalls, stats.write_stalls);
+	} else {
+		fprintf(fp, "pipewatcher: %ju bytes in, %ju out, %.1f MB/s, %.1f MB/s average, "
+		    "waited %.1fs on read (%u stalls), %.1fs on write (%u stalls)\n",
+		    stats.in, stats.out, rate, average,
+		    stats.read_wait / 1e6, stats.read_stalls,
+		    stats.write_wait / 1e6, stats.write_stalls);
+	}
+	fflush(fp);
+}
+
+static void report_last(void) {
+
+	report(stats.fp);
+	fclose(stats.fp);
+}
+
+/* Progress on one side, after waiting on it since *since */
+static void progress(uint64_t *since, uint64_t now, unsigned int *stalls) {
+
+	if(now - *since >= STALL_USEC)
+		(*stalls)++;
+	*since = now;
+}
+
+static void tick(int sig) {
+
+	if(sig == SIGINFO) {
+		info_due = 1;
+		return;
+	}
+	stats_due = 1;
+	if(++noop_interval >= NOOP_LIMIT) {
+		kill(watched_pid, SIGTERM);
+		_exit(2);
+	}
+}
+
+/* What the signals in relay mode asked for, once the syscall they cut short is back */
+static void relay_reports(void) {
+
+	if(info_due) {
+		info_due = 0;
+		report(stderr);
+	}
+	if(stats_due) {
+		stats_due = 0;
+		if(stats.fp != NULL)
+			report(stats.fp);
+	}
+}
+
+/*
+ * Relay mode (-z). FreeBSD has no splice(), but a blocking write of at
+ * least a page into a pipe is handed over by the kernel straight from our
+ * pages to the reader on the other end, which saves one of the two copies
+ * read()/write() cost. So both descriptors stay blocking, whatever is
+ * waiting in stdin is gathered into a large page-aligned buffer and
+ * written out in one go, and the watchdog runs off an interval timer
+ * instead of select() timeouts. The timer and SIGINFO interrupt the
+ * blocking calls, which is when the reports get written.
+ */
+static void relay(size_t buffer_size) {
+
+	struct sigaction sa;
+	struct itimerval interval = {{STATS_INTERVAL, 0}, {STATS_INTERVAL, 0}};
+	char *buffer;
+	ssize_t size;
+	size_t fill, written;
+	uint64_t since, now;
+	int avail, eof, flags;
+
+	flags = fcntl(STDIN_FILENO, F_GETFL);
+	fcntl(STDIN_FILENO, F_SETFL, flags & ~O_NONBLOCK);
+
+	flags = fcntl(STDOUT_FILENO, F_GETFL);
+	fcntl(STDOUT_FILENO, F_SETFL, flags & ~O_NONBLOCK);
+
+	buffer = mmap(NULL, buffer_size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+	if(buffer == MAP_FAILED) {
+		perror("Failed to allocate relay buffer");
+		exit(1);
+	}
+
+	sa.sa_handler = tick;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, NULL);
+	sigaction(SIGINFO, &sa, NULL);
+	setitimer(ITIMER_REAL, &interval, NULL);
+
+	for(eof = 0; !eof;) {
+
+		// Take what is there already, but only wait for the first of it
+		fill = 0;
+		since = now_usec();
+		for(;;) {
+			size = read(STDIN_FILENO, buffer + fill, buffer_size - fill);
+			if(size == -1 && errno == EINTR) {
+				relay_reports();
+				continue;
+			}
+			if(size == 0) {
+				eof = 1;
+				break;
+			} else if(size == -1) {
+				perror("Failed to read from stdin");
+				exit(1);
+			}
+			noop_interval = 0;
+			now = now_usec();
+			stats.read_wait += now - since;
+			progress(&since, now, &stats.read_stalls);
+			stats.in += size;
+			fill += size;
+			if(fill == buffer_size || ioctl(STDIN_FILENO, FIONREAD, &avail) == -1 || avail == 0)
+				break;
+		}
+
+		since = now_usec();
+		for(written = 0; written < fill;) {
+			size = write(STDOUT_FILENO, buffer + written, fill - written);
+			if(size == -1) {
+				if(errno == EINTR) {
+					relay_reports();
+					continue;
+				}
+				perror("Failed to write to stdout");
+				exit(1);
+			}
+			noop_interval = 0;
+			now = now_usec();
+			stats.write_wait += now - since;
+			progress(&since, now, &stats.write_stalls);
+			stats.out += size;
+			written += size;
+		}
+	}
+
+	exit(0);
+}
+
+/*
+ * Compression (-c) and decompression (-d) in here, so that replication is
+ * not held to the speed of the one compressor thread ahead of us. Input
+ * is cut into blocks that worker threads compress or decompress side by
+ * side while the main loop goes on reading and writing, and the blocks
+ * are written out in the order they came in. The stream is
+ *
+ *	"PWZ" algorithm
+ *	payload length	raw length	payload
+ *	...
+ *	0		0
+ *
+ * with lengths 4 bytes big-endian. A block that does not get any smaller
+ * goes as it is, with both lengths the same, and the end block tells a
+ * finished stream from one that was cut short.
+ */
+static void put32(char *p, uint32_t v) {
+
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get32(const char *p) {
+
+	const unsigned char *u = (const unsigned char *)p;
+
+	return ((uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3]);
+}
+
+static int compress_block(struct codec *c, struct block *b, void **ctx) {
+
+	char *dst = b->out + BLOCK_HEADER;
+	size_t len = 0;
+
+	// Anything that does not fit in less than it was is not worth it
+	if(c->algorithm == ALG_LZ4) {
+		len = LZ4_compress_default(b->in, dst, b->in_len, b->in_len - 1);
+	} else {
+		if(*ctx == NULL && (*ctx = ZSTD_createCCtx()) == NULL)
+			return (0);
+		len = ZSTD_compressCCtx(*ctx, dst, b->in_len - 1, b->in, b->in_len, ZSTD_CLEVEL_DEFAULT);
+		if(ZSTD_isError(len))
+			len = 0;
+	}
+	if(len == 0) {
+		memcpy(dst, b->in, b->in_len);
+		len = b->in_len;
+	}
+	put32(b->out, len);
+	put32(b->out + 4, b->in_len);
+	b->out_len = BLOCK_HEADER + len;
+	return (1);
+}
+
+static int decompress_block(struct codec *c, struct block *b, void **ctx) {
+
+	size_t len = get32(b->in), raw = get32(b->in + 4);
+	const char *src = b->in + BLOCK_HEADER;
+	int ret;
+
+	if(len == raw) {
+		memcpy(b->out, src, len);
+	} else if(c->algorithm == ALG_LZ4) {
+		ret = LZ4_decompress_safe(src, b->out, len, BLOCK_SIZE);
+		if(ret < 0 || (size_t)ret != raw)
+			return (0);
+	} else {
+		if(*ctx == NULL && (*ctx = ZSTD_createDCtx()) == NULL)
+			return (0);
+		if(ZSTD_decompressDCtx(*ctx, b->out, BLOCK_SIZE, src, len) != raw)
+			return (0);
+	}
+	b->out_len = raw;
+	return (1);
+}
+
+/*
+ * A worker takes the queued blocks in order, but may finish them out of
+ * order with the others, and pokes the main loop for each one.
+ */
+static void *codec_main(void *arg) {
+
+	struct codec *c = arg;
+	struct block *b;
+	struct kevent wake;
+	void *ctx = NULL;
+	int ok;
+
+	EV_SET(&wake, WAKE_EVENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+
+	pthread_mutex_lock(&c->lock);
+	for(;;) {
+		while(c->next_job == c->next_read)
+			pthread_cond_wait(&c->cv, &c->lock);
+		b = &c->blocks[c->next_job++ % c->nblocks];
+		pthread_mutex_unlock(&c->lock);
+
+		ok = c->decompress ? decompress_block(c, b, &ctx) : compress_block(c, b, &ctx);
+
+		pthread_mutex_lock(&c->lock);
+		b->bad = !ok;
+		b->done = 1;
+		kevent(c->kq, &wake, 1, NULL, 0, NULL);
+	}
+
+	return (NULL);
+}
+
+static void codec_start(struct codec *c, int algorithm, int decompress, int threads, int kq) {
+
+	pthread_t thread;
+	size_t size = BLOCK_HEADER + BLOCK_SIZE;
+	char *buf;
+	unsigned int i;
+
+	memset(c, 0, sizeof(*c));
+	c->decompress = decompress;
+	c->algorithm = algorithm;
+	c->kq = kq;
+	memcpy(c->header, STREAM_MAGIC, STREAM_HEADER - 1);
+	c->header[STREAM_HEADER - 1] = algorithm;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cv, NULL);
+
+	// Twice as many blocks as workers keeps them busy while the rest are read and written
+	c->nblocks = threads * 2;
+	c->blocks = calloc(c->nblocks, sizeof(*c->blocks));
+	buf = mmap(NULL, size * 2 * c->nblocks, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE|MAP_NOCORE, -1, 0);
+	if(c->blocks == NULL || buf == MAP_FAILED) {
+		perror("Failed to allocate blocks");
+		exit(1);
+	}
+	for(i = 0; i < c->nblocks; i++) {
+		c->blocks[i].in = buf + size * 2 * i;
+		c->blocks[i].out = c->blocks[i].in + size;
+	}
+
+	for(i = 0; i < (unsigned int)threads; i++) {
+		if(pthread_create(&thread, NULL, codec_main, c) != 0) {
+			perror("Failed to start workers");
+			exit(1);
+		}
+		pthread_detach(thread);
+	}
+}
+
+static void codec_queue(struct codec *c) {
+
+	pthread_mutex_lock(&c->lock);
+	c->next_read++;
+	pthread_cond_signal(&c->cv);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Where the next read goes, if anywhere. Decompressing, that is only
+ * ever up to the end of the block header or the block, so the stream
+ * never has to be taken apart again.
+ */
+static int codec_space(struct codec *c, struct iovec *iov) {
+
+	struct block *b;
+	size_t want;
+
+	if(c->decompress && c->header_off < STREAM_HEADER) {
+		iov[0].iov_base = c->header + c->header_off;
+		iov[0].iov_len = STREAM_HEADER - c->header_off;
+		return (1);
+	}
+	if(c->ended || c->next_read - c->next_write == c->nblocks)
+		return (0);
+
+	b = &c->blocks[c->next_read % c->nblocks];
+	if(!c->decompress)
+		want = BLOCK_SIZE;
+	else if(b->in_len < BLOCK_HEADER)
+		want = BLOCK_HEADER;
+	else
+		want = BLOCK_HEADER + get32(b->in);
+	iov[0].iov_base = b->in + b->in_len;
+	iov[0].iov_len = want - b->in_len;
+	return (1);
+}
+
+/*
+ * After a read of size into codec_space(). Returns whether that started
+ * a block, which is when the flush timer for it starts when compressing.
+ */
+static int codec_filled(struct codec *c, size_t size) {
+
+	struct block *b;
+	size_t len, raw;
+	int started;
+
+	if(c->decompress && c->header_off < STREAM_HEADER) {
+		c->header_off += size;
+		if(c->header_off == STREAM_HEADER) {
+			c->algorithm = c->header[STREAM_HEADER - 1];
+			if(memcmp(c->header, STREAM_MAGIC, STREAM_HEADER - 1) != 0 ||
+			    (c->algorithm != ALG_LZ4 && c->algorithm != ALG_ZSTD)) {
+				fprintf(stderr, "Not a compressed pipewatcher stream!\n");
+				exit(1);
+			}
+		}
+		return (0);
+	}
+
+	b = &c->blocks[c->next_read % c->nblocks];
+	started = b->in_len == 0;
+	b->in_len += size;
+
+	if(!c->decompress) {
+		if(b->in_len == BLOCK_SIZE)
+			codec_queue(c);
+		return (started);
+	}
+
+	if(b->in_len < BLOCK_HEADER)
+		return (0);
+	len = get32(b->in);
+	raw = get32(b->in + 4);
+	if(b->in_len == BLOCK_HEADER) {
+		if(len == 0 && raw == 0) {
+			c->ended = 1;
+			b->in_len = 0;
+			return (0);
+		}
+		if(raw == 0 || raw > BLOCK_SIZE || len == 0 || len > raw) {
+			fprintf(stderr, "Corrupt compressed stream!\n");
+			exit(1);
+		}
+	}
+	if(b->in_len == BLOCK_HEADER + len)
+		codec_queue(c);
+	return (0);
+}
+
+/* Send off what there is of the block being compressed, if anything */
+static void codec_flush(struct codec *c) {
+
+	if(c->next_read - c->next_write < c->nblocks && c->blocks[c->next_read % c->nblocks].in_len > 0)
+		codec_queue(c);
+}
+
+static void codec_eof(struct codec *c) {
+
+	c->eof = 1;
+	if(c->decompress) {
+		fprintf(stderr, "Compressed stream cut short!\n");
+		exit(1);
+	}
+	codec_flush(c);
+}
+
+/* What goes out next, the stream header, a block that is done, or the end */
+static int codec_data(struct codec *c, struct iovec *iov) {
+
+	struct block *b;
+	int done;
+
+	if(!c->decompress && c->header_off < STREAM_HEADER) {
+		iov[0].iov_base = c->header + c->header_off;
+		iov[0].iov_len = STREAM_HEADER - c->header_off;
+		return (1);
+	}
+
+	if(c->next_write < c->next_read) {
+		b = &c->blocks[c->next_write % c->nblocks];
+		pthread_mutex_lock(&c->lock);
+		done = b->done;
+		pthread_mutex_unlock(&c->lock);
+		if(!done)
+			return (0);
+		if(b->bad) {
+			fprintf(stderr, "Corrupt compressed block!\n");
+			exit(1);
+		}
+		iov[0].iov_base = b->out + b->out_off;
+		iov[0].iov_len = b->out_len - b->out_off;
+		return (1);
+	}
+
+	if(!c->decompress && c->eof && c->trailer_off < BLOCK_HEADER) {
+		iov[0].iov_base = c->trailer + c->trailer_off;
+		iov[0].iov_len = BLOCK_HEADER - c->trailer_off;
+		return (1);
+	}
+	return (0);
+}
+
+/* After a write of size out of codec_data() */
+static void codec_written(struct codec *c, size_t size) {
+
+	struct block *b;
+
+	if(!c->decompress && c->header_off < STREAM_HEADER) {
+		c->header_off += size;
+	} else if(c->next_write < c->next_read) {
+		b = &c->blocks[c->next_write % c->nblocks];
+		b->out_off += size;
+		if(b->out_off == b->out_len) {
+			pthread_mutex_lock(&c->lock);
+			b->in_len = b->out_len = b->out_off = 0;
+			b->done = 0;
+			c->next_write++;
+			pthread_mutex_unlock(&c->lock);
+		}
+	} else {
+		c->trailer_off += size;
+	}
+}
+
+static int codec_finished(struct codec *c) {
+
+	if(c->next_write != c->next_read)
+		return (0);
+	if(c->decompress)
+		return (c->ended);
+	return (c->eof && c->trailer_off == BLOCK_HEADER);
+}
 
 
 int main(int argc, char **argv) {
 
-	fd_set fds_read, fds_write;
-	char buffer[BUFFER_SIZE];
-	struct timeval timeout = {1, 0};
-	int rv, read_size, write_size, write_accum_size, noop_read_interval, noop_write_interval, flags;
+	struct kevent changes[10], events[4];
+	struct iovec iov[2];
+	struct ring ring;
+	struct codec codec;
+	ssize_t size;
+	int kq, nchanges, nevents, i, flags, ch, zflag = 0, dflag = 0, algorithm = 0, threads = 0, coding, flushing = 0;
+	int eof = 0, reading = 0, writing = 0, want_read, want_write, read_progress, write_progress;
+	int high = 0, low = 100, niov;
+	size_t buffer_size = 0;
+	uint64_t before, now, read_since = 0, write_since = 0;
+	char *stats_file = NULL;
+
+	while((ch = getopt(argc, argv, "b:c:dj:P:p:s:z")) != -1) {
+		switch(ch) {
+		case 'c':
+			if(strcmp(optarg, "lz4") == 0)
+				algorithm = ALG_LZ4;
+			else if(strcmp(optarg, "zstd") == 0)
+				algorithm = ALG_ZSTD;
+			else {
+				fprintf(stderr, "-c takes lz4 or zstd!\n");
+				exit(1);
+			}
+			break;
+		case 'd':
+			dflag = 1;
+			break;
+		case 'j':
+			if((threads = atoi(optarg)) < 1) {
+				fprintf(stderr, "-j takes a number of threads!\n");
+				exit(1);
+			}
+			break;
+		case 'b':
+			if((buffer_size = parse_size(optarg)) < MIN_BUFFER_SIZE) {
+				fprintf(stderr, "The buffer must be at least %d bytes!\n", MIN_BUFFER_SIZE);
+				exit(1);
+			}
+			break;
+		case 'P':
+			if((high = parse_percent(optarg)) == -1) {
+				fprintf(stderr, "-P takes a percentage!\n");
+				exit(1);
+			}
+			break;
+		case 'p':
+			if((low = parse_percent(optarg)) == -1) {
+				fprintf(stderr, "-p takes a percentage!\n");
+				exit(1);
+			}
+			break;
+		case 's':
+			stats_file = optarg;
+			break;
+		case 'z':
+			zflag = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: pipewatcher [-z] [-b size] [-P percent] [-p percent] [-s stats file] pid\n"
+			    "       pipewatcher -c lz4|zstd | -d [-j threads] [-s stats file] pid\n");
+			exit(1);
+		}
+	}
+	coding = algorithm != 0 || dflag;
+	if(coding && ((algorithm != 0 && dflag) || zflag || buffer_size != 0 || high != 0 || low != 100)) {
+		fprintf(stderr, "-c and -d go with neither each other nor -z, -b, -P or -p!\n");
+		exit(1);
+	}
+	if(threads == 0 && (threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		threads = 1;
+	argc -= optind;
+	argv += optind;
 
-	if(argc != 2) {
+	if(argc != 1) {
 		fprintf(stderr, "pipewatcher needs a pid!\n");
 		exit(1);
 	}
+	watched_pid = atoi(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	stats.start = stats.last = now_usec();
+	if(stats_file != NULL) {
+		if((stats.fp = fopen(stats_file, "w")) == NULL) {
+			perror(stats_file);
+			exit(1);
+		}
+		atexit(report_last);
+	}
+
+	if(zflag)
+		relay(buffer_size != 0 ? buffer_size : RELAY_SIZE);
 
 	flags = fcntl(STDIN_FILENO, F_GETFL);
 	fcntl(STDIN_FILENO, F_SETFL, flags|O_NONBLOCK);
@@ -28,73 +780,191 @@ int main(int argc, char **argv) {
 	flags = fcntl(STDOUT_FILENO, F_GETFL);
 	fcntl(STDOUT_FILENO, F_SETFL, flags|O_NONBLOCK);
 
-	signal(SIGPIPE, SIG_IGN);
+	/*
+	 * A large -b lets zfs send and the receiving end each go at their
+	 * own pace, with -P and -p (as in mbuffer) keeping either side from
+	 * waking up for every little bit the other one manages. The ring is
+	 * an anonymous mapping, so it only takes memory as it fills up, and
+	 * stays out of core dumps.
+	 */
+	ring.size = buffer_size != 0 ? buffer_size : BUFFER_SIZE;
+	ring.head = ring.len = 0;
+	ring.high = ring.size / 100 * high;
+	ring.low = ring.size / 100 * low;
+	ring.write_hold = ring.read_hold = 0;
+	ring.buf = mmap(NULL, ring.size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE|MAP_NOCORE, -1, 0);
+	if(ring.buf == MAP_FAILED) {
+		perror("Failed to allocate buffer");
+		exit(1);
+	}
+
+	if((kq = kqueue()) == -1) {
+		perror("kqueue");
+		exit(1);
+	}
 
-	noop_read_interval = noop_write_interval = 0;
-	FD_ZERO(&fds_read);
-	FD_ZERO(&fds_write);
+	if(coding)
+		codec_start(&codec, algorithm, dflag, threads, kq);
+
+	/*
+	 * Both descriptors are watched all the time, stdin while there is room
+	 * in the ring and stdout while there is something in it. Each has a
+	 * timer that is armed while it is watched and started over whenever
+	 * it gets anywhere, so nothing happening on either for NOOP_LIMIT
+	 * seconds kills the pid, see #16023. With -c or -d, stdin is watched
+	 * while there is a block to read into and stdout while the one due
+	 * next is done, and the workers wake us up whenever one is.
+	 */
+	nchanges = 0;
+	EV_SET(&changes[nchanges++], STDIN_FILENO, EVFILT_READ, EV_ADD|EV_DISABLE, 0, 0, NULL);
+	EV_SET(&changes[nchanges++], STDOUT_FILENO, EVFILT_WRITE, EV_ADD|EV_DISABLE, 0, 0, NULL);
+	EV_SET(&changes[nchanges++], SIGINFO, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+	EV_SET(&changes[nchanges++], WAKE_EVENT, EVFILT_USER, EV_ADD|EV_CLEAR, 0, 0, NULL);
+	if(stats.fp != NULL)
+		EV_SET(&changes[nchanges++], STATS_TIMER, EVFILT_TIMER, EV_ADD, 0, STATS_INTERVAL * 1000, NULL);
+	read_progress = write_progress = 0;
 
 	for(;;) {
 
-		FD_SET(STDIN_FILENO, &fds_read);
-		rv = select(STDIN_FILENO+1 , &fds_read, NULL, NULL, &timeout);
-		if (rv < 0) {
+		if(coding) {
+			if(codec_finished(&codec))
+				exit(0);
+			want_read = !eof && codec_space(&codec, iov) > 0;
+			want_write = codec_data(&codec, iov) > 0;
+		} else {
+			if(eof && ring.len == 0)
+				exit(0);
+
+			if(ring.len == 0)
+				ring.write_hold = ring.high > 0;
+			else if(ring.write_hold && (ring.len >= ring.high || eof))
+				ring.write_hold = 0;
+			if(ring.len == ring.size)
+				ring.read_hold = ring.low < ring.size;
+			else if(ring.read_hold && ring.len <= ring.low)
+				ring.read_hold = 0;
+
+			want_read = !eof && ring.len < ring.size && !ring.read_hold;
+			want_write = ring.len > 0 && !ring.write_hold;
+		}
+
+		if(want_read != reading) {
+			EV_SET(&changes[nchanges++], STDIN_FILENO, EVFILT_READ, want_read ? EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+			EV_SET(&changes[nchanges++], READ_TIMER, EVFILT_TIMER, want_read ? EV_ADD|EV_ONESHOT : EV_DELETE, 0, NOOP_LIMIT * 1000, NULL);
+			reading = want_read;
+			read_since = now_usec();
+		} else if(reading && read_progress) {
+			// Deleting and adding it again starts it over
+			EV_SET(&changes[nchanges++], READ_TIMER, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+			EV_SET(&changes[nchanges++], READ_TIMER, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0, NOOP_LIMIT * 1000, NULL);
+		}
+
+		if(want_write != writing) {
+			EV_SET(&changes[nchanges++], STDOUT_FILENO, EVFILT_WRITE, want_write ? EV_ENABLE : EV_DISABLE, 0, 0, NULL);
+			EV_SET(&changes[nchanges++], WRITE_TIMER, EVFILT_TIMER, want_write ? EV_ADD|EV_ONESHOT : EV_DELETE, 0, NOOP_LIMIT * 1000, NULL);
+			writing = want_write;
+			write_since = now_usec();
+		} else if(writing && write_progress) {
+			EV_SET(&changes[nchanges++], WRITE_TIMER, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+			EV_SET(&changes[nchanges++], WRITE_TIMER, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0, NOOP_LIMIT * 1000, NULL);
+		}
+
+		before = now_usec();
+		nevents = kevent(kq, changes, nchanges, events, 4, NULL);
+		if(nevents == -1) {
+			if(errno == EINTR) continue;
+			perror("kevent");
 			exit(1);
-		} else if (rv == 0) {
-			noop_read_interval++;
-			if(noop_read_interval >= 3600) {
-				/* We are over 3600 loops (~60 minutes) without receiving data, lets abort!
-				 * See #16023 */
-				kill(atoi(argv[1]), SIGTERM);
+		}
+		nchanges = 0;
+		read_progress = write_progress = 0;
+
+		// Waiting on both sides at once is nobody's fault
+		now = now_usec();
+		if(reading && !writing)
+			stats.read_wait += now - before;
+		else if(writing && !reading)
+			stats.write_wait += now - before;
+
+		for(i = 0; i < nevents; i++) {
+
+			switch(events[i].filter) {
+			case EVFILT_TIMER:
+				if(events[i].ident == STATS_TIMER) {
+					report(stats.fp);
+					break;
+				}
+				if(events[i].ident == FLUSH_TIMER) {
+					codec_flush(&codec);
+					flushing = 0;
+					break;
+				}
+				kill(watched_pid, SIGTERM);
 				exit(2);
-			}
-		} else if (rv) {
-			if(!FD_ISSET(STDIN_FILENO, &fds_read)) continue;
-			// Reset read interval if something could be read
-			noop_read_interval = 0;
-			if((read_size = read(STDIN_FILENO, &buffer, BUFFER_SIZE)) == 0) {
-				exit(0);
-			} else if(read_size == -1 && errno != EAGAIN) {
-				perror("Failed to read from stdin");
-				exit(1);
-			}
 
-			write_accum_size = 0;
-			for(;;) {
+			case EVFILT_SIGNAL:
+				report(stderr);
+				break;
 
-				write_size = write(STDOUT_FILENO, buffer + write_accum_size, read_size - write_accum_size);
+			case EVFILT_USER:
+				// A block is done, which the top of the loop will see
+				break;
 
-				if(write_size == -1) {
+			case EVFILT_READ:
+				if(!reading) break;
+				// A flush earlier in this batch can have queued the last free block,
+				// and a read into nothing would look like the end of the input
+				niov = coding ? codec_space(&codec, iov) : ring_space(&ring, iov);
+				if(niov == 0) break;
+				size = readv(STDIN_FILENO, iov, niov);
+				if(size == 0) {
+					eof = 1;
+					if(coding)
+						codec_eof(&codec);
+				} else if(size == -1) {
 					if(errno != EAGAIN) {
-						perror("Failed to write to stdout");
+						perror("Failed to read from stdin");
 						exit(1);
 					}
 				} else {
-					write_accum_size += write_size;
-				}
-				if(write_accum_size == read_size) break;
-
-
-				FD_SET(STDOUT_FILENO, &fds_write);
-				rv = select(STDOUT_FILENO+1 , NULL, &fds_write, NULL, &timeout);
-				if(rv < 0) {
-					exit(1);
-				} else if(rv == 0) {
-					noop_write_interval++;
-					if(noop_write_interval >= 3600) {
-						/* We are over 3600 loops (~60 minutes) without receiving data, lets abort!
-						 * See #16023 */
-						kill(atoi(argv[1]), SIGTERM);
-						exit(2);
+					if(!coding) {
+						ring.len += size;
+					} else if(codec_filled(&codec, size)) {
+						// So that a slow sender does not keep what it sent from going out
+						if(flushing)
+							EV_SET(&changes[nchanges++], FLUSH_TIMER, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+						EV_SET(&changes[nchanges++], FLUSH_TIMER, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0, FLUSH_MSEC, NULL);
+						flushing = 1;
 					}
-				} else if(rv) {
-					// Reset write interval if something could be written
-					noop_write_interval = 0;
+					stats.in += size;
+					read_progress = 1;
+					progress(&read_since, now, &stats.read_stalls);
 				}
+				break;
 
+			case EVFILT_WRITE:
+				if(!writing) break;
+				size = writev(STDOUT_FILENO, iov, coding ? codec_data(&codec, iov) : ring_data(&ring, iov));
+				if(size == -1) {
+					if(errno != EAGAIN) {
+						perror("Failed to write to stdout");
+						exit(1);
+					}
+				} else {
+					if(coding) {
+						codec_written(&codec, size);
+					} else {
+						ring.head = (ring.head + size) % ring.size;
+						ring.len -= size;
+						if(ring.len == 0) ring.head = 0;
+					}
+					stats.out += size;
+					write_progress = 1;
+					progress(&write_since, now, &stats.write_stalls);
+				}
+				break;
 			}
 		}
-
 	}
 
 	return 0;
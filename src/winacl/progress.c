@@ -0,0 +1,186 @@
+/*-
+ * Copyright 2018 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * -P progress reports for winacl.
+ *
+ * Rather than printing something for every entry like -v does, a thread
+ * wakes up every WA_PROGRESS_INTERVAL seconds and writes one line of tab
+ * separated totals, the same way extract-tarball keeps its status file:
+ *
+ *	visited	written	skipped	errors	entries/s
+ *
+ * entries/s covers the last interval only. The walkers hand their counts
+ * over every WA_FLUSH_COUNT entries or so, see flush_windows_acl_stats(),
+ * so the totals may trail a little, but nobody pays for them per entry.
+ * A last line with the final totals is written once the walk is done.
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "winacl.h"
+
+#define	WA_PROGRESS_INTERVAL	1
+
+struct windows_acl_progress {
+	struct windows_acl_info *w;
+	FILE *fp;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	int done;
+	struct timespec last;		/* time of the last report */
+	uintmax_t visited;		/* entries visited by then */
+};
+
+
+static void
+wa_progress_report(struct windows_acl_progress *p)
+{
+	struct windows_acl_stats stats;
+	struct timespec now;
+	uintmax_t rate = 0;
+	double secs;
+
+	pthread_mutex_lock(&p->w->stats_lock);
+	stats = p->w->stats;
+	pthread_mutex_unlock(&p->w->stats_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - p->last.tv_sec) +
+		(now.tv_nsec - p->last.tv_nsec) / 1000000000.0;
+	if (secs > 0)
+		rate = (stats.visited - p->visited) / secs;
+
+	p->last = now;
+	p->visited = stats.visited;
+
+	fprintf(p->fp, "%ju\t%ju\t%ju\t%ju\t%ju\n", stats.visited,
+		stats.written, stats.skipped, stats.errors, rate);
+	fflush(p->fp);
+}
+
+
+static void *
+wa_progress_main(void *arg)
+{
+	struct windows_acl_progress *p = arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->done) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += WA_PROGRESS_INTERVAL;
+
+		while (!p->done &&
+			pthread_cond_timedwait(&p->cv, &p->lock, &ts) != ETIMEDOUT)
+			;
+
+		if (!p->done)
+			wa_progress_report(p);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return (NULL);
+}
+
+
+/* arg is a file to create, or the number of an open descriptor */
+int
+start_windows_acl_progress(struct windows_acl_info *w, const char *arg)
+{
+	struct windows_acl_progress *p;
+	pthread_condattr_t attr;
+	const char *errstr;
+	int fd, ret;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		err(EX_OSERR, "calloc() failed");
+
+	/* a copy of the descriptor, so that closing ours leaves stdout be */
+	fd = strtonum(arg, 0, INT_MAX, &errstr);
+	if (errstr == NULL) {
+		if ((fd = dup(fd)) >= 0 && (p->fp = fdopen(fd, "w")) == NULL)
+			close(fd);
+	} else {
+		p->fp = fopen(arg, "w");
+	}
+	if (p->fp == NULL) {
+		free(p);
+		return (-1);
+	}
+
+	p->w = w;
+	clock_gettime(CLOCK_MONOTONIC, &p->last);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->cv, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if ((ret = pthread_create(&p->thread, NULL, wa_progress_main, p)) != 0)
+		errc(EX_OSERR, ret, "pthread_create() failed");
+
+	w->progress = p;
+	return (0);
+}
+
+
+void
+stop_windows_acl_progress(struct windows_acl_info *w)
+{
+	struct windows_acl_progress *p = w->progress;
+
+	if (p == NULL)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	pthread_cond_signal(&p->cv);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+
+	wa_progress_report(p);
+	if (fclose(p->fp) < 0)
+		warn("fclose");
+
+	pthread_cond_destroy(&p->cv);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+	w->progress = NULL;
+}
@@ -0,0 +1,807 @@
+/*-
+ * Copyright 2018 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Tree walker for winacl.
+ *
+ * Every directory is opened once, and its entries are looked at and
+ * changed relative to that descriptor (fstatat, openat, acl_set_fd_np,
+ * fchown) rather than by full path, so deep trees do not pay a lookup of
+ * every path component for every file. Should openat() fail for an entry
+ * we fall back to the old path based calls for it.
+ *
+ * The tree is cut into work units, one per directory. Every worker owns
+ * a deque of units: it pushes and pops at the tail, so on its own it walks
+ * depth first the same way fts does, while idle workers steal from the
+ * head, where the oldest and usually largest subtrees are. Regular files
+ * are handed out in batches of WA_BATCH_SIZE so that a single huge
+ * directory gets spread over all the workers as well.
+ *
+ * The mountpoint and loop checks are done once per directory, on the
+ * descriptor of the unit itself, so entries only need to be told apart
+ * as directory, regular file or other. With -u we take that from d_type
+ * and only stat() entries the filesystem would not classify for us, or
+ * symlinks we have to follow.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "winacl.h"
+
+#define	WA_BATCH_SIZE	256
+#define	WA_DEQUE_SIZE	64
+
+struct wa_dirid {
+	dev_t dev;
+	ino_t ino;
+};
+
+struct wa_unit {
+	char *path;			/* directory, or parent of the batch */
+	int level;			/* fts level of path */
+	dev_t dev;			/* device of the parent, then of path */
+	char *names;			/* NUL separated regular files in path */
+	size_t nameslen;
+	size_t namessize;
+	int nnames;
+	struct wa_dirid *ancestors;	/* parents of path, then path (-l unset) */
+	int nancestors;
+};
+
+struct wa_pool;
+
+struct wa_worker {
+	pthread_t thread;
+	struct wa_pool *pool;
+	pthread_mutex_t lock;
+	struct wa_unit **units;
+	size_t head;
+	size_t count;
+	size_t size;
+	int id;
+	int rval;
+	struct windows_acl_stats stats;
+	struct ea_arena arena;		/* for -E */
+	char *path;			/* the current entry, for messages */
+	size_t pathsize;
+};
+
+struct wa_pool {
+	struct windows_acl_info *w;
+	struct wa_worker *workers;
+	int nworkers;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	long queued;			/* units sitting in a deque */
+	long pending;			/* units queued or being worked on */
+	int waiting;
+};
+
+
+static char *
+wa_join(const char *dir, const char *name)
+{
+	char *path;
+	size_t len;
+
+	len = strlen(dir);
+	if (asprintf(&path, "%s%s%s", dir,
+		(len > 0 && dir[len - 1] == '/') ? "" : "/", name) < 0)
+		err(EX_OSERR, "asprintf() failed");
+
+	return (path);
+}
+
+
+static struct wa_unit *
+wa_unit_new(char *path, int level)
+{
+	struct wa_unit *u;
+
+	if ((u = calloc(1, sizeof(*u))) == NULL)
+		err(EX_OSERR, "calloc() failed");
+
+	u->path = path;
+	u->level = level;
+
+	return (u);
+}
+
+
+/* child directory unit, remembering where we came from to catch loops */
+static struct wa_unit *
+wa_unit_child(struct wa_pool *pool, struct wa_unit *parent, char *path)
+{
+	struct wa_unit *u;
+
+	u = wa_unit_new(path, parent->level + 1);
+	u->dev = parent->dev;
+	if (pool->w->flags & WA_PHYSICAL)
+		return (u);
+
+	/* one spare slot, for the child itself once it has been opened */
+	u->nancestors = parent->nancestors;
+	if ((u->ancestors = calloc(u->nancestors + 1,
+		sizeof(*u->ancestors))) == NULL)
+		err(EX_OSERR, "calloc() failed");
+	memcpy(u->ancestors, parent->ancestors,
+		parent->nancestors * sizeof(*u->ancestors));
+
+	return (u);
+}
+
+
+static void
+wa_unit_add_name(struct wa_unit *u, const char *name)
+{
+	size_t len;
+
+	len = strlen(name) + 1;
+	if (u->nameslen + len > u->namessize) {
+		u->namessize = (u->namessize + len) * 2;
+		if ((u->names = realloc(u->names, u->namessize)) == NULL)
+			err(EX_OSERR, "realloc() failed");
+	}
+
+	memcpy(u->names + u->nameslen, name, len);
+	u->nameslen += len;
+	u->nnames++;
+}
+
+
+static void
+wa_unit_free(struct wa_unit *u)
+{
+	if (u == NULL)
+		return;
+
+	free(u->path);
+	free(u->names);
+	free(u->ancestors);
+	free(u);
+}
+
+
+/* same test fts uses for FTS_DC, and remember u for its children */
+static int
+wa_is_cycle(struct wa_unit *u, struct stat *st)
+{
+	int i;
+
+	for (i = 0;i < u->nancestors;i++) {
+		if (u->ancestors[i].dev == st->st_dev &&
+			u->ancestors[i].ino == st->st_ino)
+			return (1);
+	}
+
+	u->ancestors[u->nancestors].dev = st->st_dev;
+	u->ancestors[u->nancestors].ino = st->st_ino;
+	u->nancestors++;
+
+	return (0);
+}
+
+
+static void
+wa_push(struct wa_worker *wk, struct wa_unit *u)
+{
+	struct wa_pool *pool = wk->pool;
+
+	/* account for the unit before anyone can steal and finish it */
+	pthread_mutex_lock(&pool->lock);
+	pool->pending++;
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_lock(&wk->lock);
+	if (wk->count == wk->size) {
+		struct wa_unit **units;
+		size_t i;
+
+		if ((units = calloc(wk->size * 2, sizeof(*units))) == NULL)
+			err(EX_OSERR, "calloc() failed");
+		for (i = 0;i < wk->count;i++)
+			units[i] = wk->units[(wk->head + i) % wk->size];
+
+		free(wk->units);
+		wk->units = units;
+		wk->head = 0;
+		wk->size *= 2;
+	}
+	wk->units[(wk->head + wk->count) % wk->size] = u;
+	wk->count++;
+	pthread_mutex_unlock(&wk->lock);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued++;
+	if (pool->waiting > 0)
+		pthread_cond_signal(&pool->cv);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* take from the tail of our own deque, or steal from the head of another */
+static struct wa_unit *
+wa_take(struct wa_worker *wk, int steal)
+{
+	struct wa_unit *u = NULL;
+
+	pthread_mutex_lock(&wk->lock);
+	if (wk->count > 0) {
+		if (steal) {
+			u = wk->units[wk->head];
+			wk->head = (wk->head + 1) % wk->size;
+		} else {
+			u = wk->units[(wk->head + wk->count - 1) % wk->size];
+		}
+		wk->count--;
+	}
+	pthread_mutex_unlock(&wk->lock);
+
+	if (u != NULL) {
+		pthread_mutex_lock(&wk->pool->lock);
+		wk->pool->queued--;
+		pthread_mutex_unlock(&wk->pool->lock);
+	}
+
+	return (u);
+}
+
+
+/* the path based calls cannot take what only fts could get to by chdir */
+static void
+wa_apply_path(struct windows_acl_info *w, struct windows_acl_stats *stats,
+	const char *path, int level, int isdir)
+{
+	int ret;
+
+	if (strlen(path) >= PATH_MAX) {
+		warnx("%s: %s", path, strerror(ENAMETOOLONG));
+		stats->errors++;
+		return;
+	}
+
+	if ((ret = set_windows_acl_path(w, path, level, isdir)) < 0)
+		err(EX_OSERR, "%s: set_windows_acl() failed", path);
+	count_windows_acl(stats, ret);
+}
+
+
+static void
+wa_apply_at(struct windows_acl_info *w, struct windows_acl_stats *stats,
+	struct ea_arena *a, int dfd, const char *name, const char *path,
+	int level, int isdir)
+{
+	int fd, flags, ret;
+
+	flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+	if (isdir)
+		flags |= O_DIRECTORY;
+	if (w->flags & WA_PHYSICAL)
+		flags |= O_NOFOLLOW;
+
+	if (dfd == -1 || (fd = openat(dfd, name, flags)) < 0) {
+		wa_apply_path(w, stats, path, level, isdir);
+		return;
+	}
+
+	if ((ret = set_windows_acl_fd(w, fd, path, level, isdir)) < 0)
+		err(EX_OSERR, "%s: set_windows_acl() failed", path);
+	count_windows_acl(stats, ret);
+
+	if (fix_windows_acl_ea(w, fd, path, a) < 0)
+		stats->errors++;
+
+	close(fd);
+}
+
+
+static void
+wa_path_reserve(struct wa_worker *wk, size_t len)
+{
+	if (len < wk->pathsize)
+		return;
+
+	wk->pathsize = MAX(len + 1, MAX(wk->pathsize * 2, PATH_MAX));
+	if ((wk->path = realloc(wk->path, wk->pathsize)) == NULL)
+		err(EX_OSERR, "realloc() failed");
+}
+
+
+/* copy dir and a slash into the path buffer, entry names go after it */
+static size_t
+wa_path_prefix(struct wa_worker *wk, const char *dir)
+{
+	size_t len;
+
+	len = strlen(dir);
+	wa_path_reserve(wk, len + 1);
+	memcpy(wk->path, dir, len + 1);
+
+	if (len == 0 || wk->path[len - 1] != '/') {
+		wk->path[len++] = '/';
+		wk->path[len] = '\0';
+	}
+
+	return (len);
+}
+
+
+/* the entry name after the prefix of plen bytes */
+static void
+wa_path_name(struct wa_worker *wk, size_t plen, const char *name)
+{
+	size_t len;
+
+	len = strlen(name);
+	wa_path_reserve(wk, plen + len);
+	memcpy(wk->path + plen, name, len + 1);
+}
+
+
+/*
+ * Paths that do not fit in PATH_MAX are opened a piece at a time, each
+ * piece relative to the one before, the way fts gets there by chdir.
+ */
+static int
+wa_open_dir(const char *path)
+{
+	const char *p;
+	char piece[PATH_MAX];
+	size_t len;
+	int dfd, fd, error;
+
+	if (strlen(path) < PATH_MAX)
+		return (open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+
+	dfd = AT_FDCWD;
+	for (p = path;*p != '\0';p += len) {
+		/* as much as fits, cut after a slash */
+		if ((len = strlen(p)) >= PATH_MAX) {
+			for (len = PATH_MAX - 1;len > 0 && p[len - 1] != '/';len--)
+				;
+		}
+
+		fd = -1;
+		error = ENAMETOOLONG;
+		if (len > 0) {
+			memcpy(piece, p, len);
+			piece[len] = '\0';
+			fd = openat(dfd, piece, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			error = errno;
+		}
+
+		if (dfd != AT_FDCWD)
+			close(dfd);
+		if (fd < 0) {
+			errno = error;
+			return (-1);
+		}
+		dfd = fd;
+	}
+
+	return (dfd);
+}
+
+
+/*
+ * d_type of the entry, stat()ing it only if we have to. DT_UNKNOWN if
+ * the entry could not be looked at.
+ */
+static int
+wa_entry_type(struct wa_worker *wk, int dfd, struct dirent *dp)
+{
+	struct windows_acl_info *w = wk->pool->w;
+	struct stat st;
+	int type = DT_UNKNOWN;
+
+	if (w->flags & WA_UNORDERED) {
+		type = dp->d_type;
+		if (type == DT_LNK && (w->flags & WA_PHYSICAL) == 0)
+			type = DT_UNKNOWN;
+		if (type != DT_UNKNOWN)
+			return (type);
+	}
+
+	if (fstatat(dfd, dp->d_name, &st,
+		(w->flags & WA_PHYSICAL) ? AT_SYMLINK_NOFOLLOW : 0) < 0) {
+		/* vanished, or a dangling symlink: fts skips those too */
+		if (errno != ENOENT) {
+			warnx("%s: %s", wk->path, strerror(errno));
+			wk->stats.errors++;
+			wk->rval = -2;
+		}
+		return (DT_UNKNOWN);
+	}
+
+	return (IFTODT(st.st_mode));
+}
+
+
+/* dfd is the already open directory, or -1 if we have to open it */
+static void
+wa_apply_batch(struct wa_worker *wk, struct wa_unit *u, int dfd)
+{
+	struct windows_acl_info *w = wk->pool->w;
+	int i, opened = 0;
+	size_t plen;
+	char *name;
+
+	if (dfd == -1 && (dfd = wa_open_dir(u->path)) >= 0)
+		opened = 1;
+
+	plen = wa_path_prefix(wk, u->path);
+	for (i = 0, name = u->names;i < u->nnames;
+		i++, name += strlen(name) + 1) {
+		wa_path_name(wk, plen, name);
+		wa_apply_at(w, &wk->stats, &wk->arena, dfd, name, wk->path,
+			u->level + 1, 0);
+	}
+
+	if (opened)
+		close(dfd);
+}
+
+
+static void
+wa_read_dir(struct wa_worker *wk, struct wa_unit *u)
+{
+	struct wa_pool *pool = wk->pool;
+	struct windows_acl_info *w = pool->w;
+	struct wa_unit *batch = NULL;
+	struct dirent *dp;
+	struct stat st;
+	DIR *dirp;
+	size_t plen;
+	int dfd, error, ret, type, sampled, mountpoint = 0;
+
+	/* with -n -S, only some directories have their entries checked */
+	sampled = sample_windows_acl(w, u->path, strlen(u->path), u->level);
+
+	if ((dfd = wa_open_dir(u->path)) < 0) {
+		error = errno;
+
+		/* the ACL may still be settable even if we can't read it */
+		wk->stats.dirs++;
+		if (sampled)
+			wa_apply_path(w, &wk->stats, u->path, u->level, 1);
+		warnx("%s: %s", u->path, strerror(error));
+		wk->stats.errors++;
+		wk->rval = -2;
+		return;
+	}
+
+	/* needed for the mountpoint and loop checks, and for -n's numbers */
+	if (fstat(dfd, &st) < 0) {
+		warnx("%s: %s", u->path, strerror(errno));
+		close(dfd);
+		wk->stats.errors++;
+		wk->rval = -2;
+		return;
+	}
+
+	if ((w->flags & WA_PHYSICAL) == 0 && wa_is_cycle(u, &st)) {
+		close(dfd);
+		return;
+	}
+
+	wk->stats.dirs++;
+	if (sampled) {
+		if ((ret = set_windows_acl_fd(w, dfd, u->path, u->level, 1)) < 0)
+			err(EX_OSERR, "%s: set_windows_acl() failed", u->path);
+		count_windows_acl(&wk->stats, ret);
+
+		if (fix_windows_acl_ea(w, dfd, u->path, &wk->arena) < 0)
+			wk->stats.errors++;
+	}
+
+	if (u->level > FTS_ROOTLEVEL && st.st_dev != u->dev) {
+		wk->stats.mounts++;
+		mountpoint = 1;
+	}
+	u->dev = st.st_dev;
+
+	/* like FTS_XDEV, set the mountpoint but do not descend */
+	if ((w->flags & WA_TRAVERSE) == 0 && mountpoint) {
+		close(dfd);
+		return;
+	}
+
+	if ((dirp = fdopendir(dfd)) == NULL) {
+		warnx("%s: %s", u->path, strerror(errno));
+		close(dfd);
+		wk->stats.errors++;
+		wk->rval = -2;
+		return;
+	}
+
+	plen = wa_path_prefix(wk, u->path);
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+			continue;
+
+		wa_path_name(wk, plen, dp->d_name);
+		if (skip_windows_acl(w, wk->path))
+			continue;
+
+		/* a huge directory should not keep -P waiting until it is done */
+		if (++wk->stats.visited % WA_FLUSH_COUNT == 0)
+			flush_windows_acl_stats(w, &wk->stats);
+
+		type = wa_entry_type(wk, dfd, dp);
+
+		if (type == DT_DIR) {
+			/* its ACL gets set once the unit has it open */
+			wa_push(wk, wa_unit_child(pool, u,
+				wa_join(u->path, dp->d_name)));
+
+		} else if (type == DT_REG) {
+			wk->stats.files++;
+			if (!sampled)
+				continue;
+
+			/* nobody to share with */
+			if (pool->nworkers == 1) {
+				wa_apply_at(w, &wk->stats, &wk->arena, dfd,
+					dp->d_name, wk->path, u->level + 1, 0);
+				continue;
+			}
+
+			if (batch == NULL) {
+				char *path;
+
+				if ((path = strdup(u->path)) == NULL)
+					err(EX_OSERR, "strdup() failed");
+				batch = wa_unit_new(path, u->level);
+				batch->dev = u->dev;
+			}
+
+			wa_unit_add_name(batch, dp->d_name);
+			if (batch->nnames >= WA_BATCH_SIZE) {
+				wa_push(wk, batch);
+				batch = NULL;
+			}
+		}
+	}
+
+	/* nobody else would get to the tail end before us anyway */
+	if (batch != NULL) {
+		wa_apply_batch(wk, batch, dfd);
+		wa_unit_free(batch);
+	}
+
+	closedir(dirp);
+}
+
+
+static void *
+wa_worker_main(void *arg)
+{
+	struct wa_worker *wk = arg;
+	struct wa_pool *pool = wk->pool;
+	struct wa_unit *u;
+	int i, done;
+
+	for (;;) {
+		u = wa_take(wk, 0);
+		for (i = 1;u == NULL && i < pool->nworkers;i++)
+			u = wa_take(&pool->workers[(wk->id + i) % pool->nworkers], 1);
+
+		if (u != NULL) {
+			if (u->names != NULL)
+				wa_apply_batch(wk, u, -1);
+			else
+				wa_read_dir(wk, u);
+			wa_unit_free(u);
+			flush_windows_acl_stats(pool->w, &wk->stats);
+
+			pthread_mutex_lock(&pool->lock);
+			if (--pool->pending == 0)
+				pthread_cond_broadcast(&pool->cv);
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queued <= 0 && pool->pending > 0) {
+			pool->waiting++;
+			pthread_cond_wait(&pool->cv, &pool->lock);
+			pool->waiting--;
+		}
+		done = (pool->pending == 0);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (done)
+			break;
+	}
+
+	return (NULL);
+}
+
+
+/* set up the deques, the roots get pushed to worker 0 */
+static void
+wa_pool_init(struct wa_pool *pool, struct windows_acl_info *w)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->w = w;
+	pool->nworkers = w->nthreads;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cv, NULL);
+
+	if ((pool->workers = calloc(pool->nworkers,
+		sizeof(*pool->workers))) == NULL)
+		err(EX_OSERR, "calloc() failed");
+
+	for (i = 0;i < pool->nworkers;i++) {
+		struct wa_worker *wk = &pool->workers[i];
+
+		wk->pool = pool;
+		wk->id = i;
+		wk->size = WA_DEQUE_SIZE;
+		if ((wk->units = calloc(wk->size, sizeof(*wk->units))) == NULL)
+			err(EX_OSERR, "calloc() failed");
+		pthread_mutex_init(&wk->lock, NULL);
+	}
+}
+
+
+static void
+wa_pool_push_root(struct wa_pool *pool, const char *path, struct stat *st)
+{
+	struct wa_unit *root;
+	char *rpath;
+
+	if ((rpath = strdup(path)) == NULL)
+		err(EX_OSERR, "strdup() failed");
+	root = wa_unit_new(rpath, FTS_ROOTLEVEL);
+	root->dev = st->st_dev;
+	if ((pool->w->flags & WA_PHYSICAL) == 0 && (root->ancestors =
+		calloc(1, sizeof(*root->ancestors))) == NULL)
+		err(EX_OSERR, "calloc() failed");
+
+	wa_push(&pool->workers[0], root);
+}
+
+
+/* walk everything pushed so far, then tear the pool down */
+static int
+wa_pool_run(struct wa_pool *pool)
+{
+	int i, ret, rval = 0;
+
+	/* worker 0 is us */
+	for (i = 1;i < pool->nworkers;i++) {
+		if ((ret = pthread_create(&pool->workers[i].thread, NULL,
+			wa_worker_main, &pool->workers[i])) != 0)
+			errc(EX_OSERR, ret, "pthread_create() failed");
+	}
+
+	wa_worker_main(&pool->workers[0]);
+
+	for (i = 0;i < pool->nworkers;i++) {
+		if (i > 0)
+			pthread_join(pool->workers[i].thread, NULL);
+		if (pool->workers[i].rval < 0)
+			rval = pool->workers[i].rval;
+
+		free(pool->workers[i].units);
+		free(pool->workers[i].path);
+		ea_arena_free(&pool->workers[i].arena);
+		pthread_mutex_destroy(&pool->workers[i].lock);
+	}
+
+	free(pool->workers);
+	pthread_cond_destroy(&pool->cv);
+	pthread_mutex_destroy(&pool->lock);
+
+	return (rval);
+}
+
+
+int
+walk_windows_acls(struct windows_acl_info *w)
+{
+	struct windows_acl_stats stats;
+	struct ea_arena arena;
+	struct wa_pool pool;
+	struct stat st;
+	char *path;
+	int i, ret, rval = 0, started = 0;
+
+	if (w == NULL)
+		return (-1);
+
+	memset(&stats, 0, sizeof(stats));
+	memset(&arena, 0, sizeof(arena));
+
+	/* all roots end up in one pool, so the workers are shared by them */
+	for (i = 0;i < w->npaths;i++) {
+		path = w->paths[i];
+		if (skip_windows_acl(w, path))
+			continue;
+
+		stats.visited++;
+
+		if (w->flags & WA_PHYSICAL)
+			ret = lstat(path, &st);
+		else
+			ret = stat(path, &st);
+		if (ret < 0) {
+			warnx("%s: %s", path, strerror(errno));
+			stats.errors++;
+			rval = -2;
+			continue;
+		}
+
+		/*
+		 * Without -r fts hands us the root whatever it is, with -r only
+		 * directories and regular files get their ACL set.
+		 */
+		if ((w->flags & WA_RECURSIVE) == 0 || !S_ISDIR(st.st_mode)) {
+			if ((w->flags & WA_RECURSIVE) && !S_ISREG(st.st_mode))
+				continue;
+
+			if (S_ISDIR(st.st_mode))
+				stats.dirs++;
+			else
+				stats.files++;
+			wa_apply_at(w, &stats, &arena, AT_FDCWD, path, path,
+				FTS_ROOTLEVEL, S_ISDIR(st.st_mode));
+			continue;
+		}
+
+		if (!started) {
+			wa_pool_init(&pool, w);
+			started = 1;
+		}
+		wa_pool_push_root(&pool, path, &st);
+	}
+	flush_windows_acl_stats(w, &stats);
+	ea_arena_free(&arena);
+
+	if (started && (ret = wa_pool_run(&pool)) < 0)
+		rval = ret;
+
+	return (rval);
+}
@@ -30,8 +30,10 @@
 #include <sys/extattr.h>
 #include <sys/stat.h>
 #include <err.h>
+#include <fcntl.h>
 #include <fts.h>
 #include <grp.h>
+#include <limits.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -40,32 +42,7 @@
 #include <sysexits.h>
 #include <unistd.h>
 
-struct windows_acl_info {
-
-#define	WA_NULL			0x00000000	/* nothing */
-#define	WA_RECURSIVE		0x00000001	/* recursive */
-#define	WA_VERBOSE		0x00000002	/* print more stuff */
-#define	WA_RESET		0x00000004	/* set defaults */
-#define	WA_CLONE		0x00000008	/* clone an ACL */
-#define	WA_TRAVERSE		0x00000010	/* traverse filesystem mountpoints */
-#define	WA_PHYSICAL		0x00000020	/* do not follow symlinks */
-
-/* default ACL entries if none are specified */
-#define	WA_DEFAULT_ACL		"owner@:rwxpDdaARWcCos:fd:allow,group@:rwxpDdaARWcCos:fd:allow,everyone@:rxaRc:fd:allow"
-
-#define	WA_OP_SET	(WA_CLONE|WA_RESET)
-#define	WA_OP_CHECK(flags, bit) ((flags & ~bit) & WA_OP_SET)
-
-	char *source;
-	char *path;
-	acl_t source_acl;
-	acl_t dacl;
-	acl_t facl;
-	uid_t uid;
-	gid_t gid;
-	int	flags;
-};
-
+#include "winacl.h"
 
 struct {
 	const char *str;
@@ -95,6 +72,41 @@ setarg(char **pptr, const char *src)
 }
 
 
+/* append to a NULL terminated list, without trailing slashes */
+static void
+addarg(char ***plist, int *pcount, const char *src)
+{
+	char **list;
+	char *ptr;
+	size_t len;
+
+	if ((list = realloc(*plist, (*pcount + 2) * sizeof(*list))) == NULL)
+		err(EX_OSERR, "realloc() failed");
+	if ((ptr = strdup(src)) == NULL)
+		err(EX_OSERR, NULL);
+
+	len = strlen(ptr);
+	while (len > 1 && ptr[len - 1] == '/')
+		ptr[--len] = 0;
+
+	list[(*pcount)++] = ptr;
+	list[*pcount] = NULL;
+
+	*plist = list;
+}
+
+
+static void
+freeargs(char **list, int count)
+{
+	int i;
+
+	for (i = 0;i < count;i++)
+		free(list[i]);
+	free(list);
+}
+
+
 static void
 copyarg(char **pptr, const char *src)
 {
@@ -145,12 +157,27 @@ new_windows_acl_info(void)
 
 	w->source = NULL;
 	w->path = NULL;
+	w->paths = NULL;
+	w->npaths = 0;
+	w->excludes = NULL;
+	w->nexcludes = 0;
 	w->source_acl = NULL;
 	w->dacl = NULL;
 	w->facl = NULL;
+	memset(&w->source_bin, 0, sizeof(w->source_bin));
+	memset(&w->dacl_bin, 0, sizeof(w->dacl_bin));
+	memset(&w->facl_bin, 0, sizeof(w->facl_bin));
+	w->templates = NULL;
+	w->ntemplates = 0;
 	w->uid = -1;
 	w->gid = -1;
 	w->flags = 0;
+	w->ea_flags = EA_NONE;
+	w->nthreads = 1;
+	w->sample = 100;
+	memset(&w->stats, 0, sizeof(w->stats));
+	pthread_mutex_init(&w->stats_lock, NULL);
+	w->progress = NULL;
 
 	return (w);
 }
@@ -159,14 +186,30 @@ new_windows_acl_info(void)
 static void
 free_windows_acl_info(struct windows_acl_info *w)
 {
+	int i;
+
 	if (w == NULL)
 		return;
 
-	free(w->source);
-	free(w->path);
+	/* without -s, source is the same string as path */
+	if (w->source != w->path)
+		free(w->source);
+	freeargs(w->paths, w->npaths);
+	freeargs(w->excludes, w->nexcludes);
 	acl_free(w->source_acl);
 	acl_free(w->dacl);
 	acl_free(w->facl);
+	free(w->source_bin.aces);
+	free(w->dacl_bin.aces);
+	free(w->facl_bin.aces);
+	for (i = 0;i < w->ntemplates;i++) {
+		acl_free(w->templates[i].dacl);
+		acl_free(w->templates[i].facl);
+		free(w->templates[i].dacl_bin.aces);
+		free(w->templates[i].facl_bin.aces);
+	}
+	free(w->templates);
+	pthread_mutex_destroy(&w->stats_lock);
 	free(w);
 }
 
@@ -179,7 +222,15 @@ usage(char *path)
 		"Usage: %s [OPTIONS] ...\n"
 		"Where option is:\n"
 		"    -s <path>                    # source for ACL. If none specified then ACL taken from -p\n"
-		"    -p <path>                    # path to recursively set ACL\n"
+		"    -F                           # use the path based fts walker\n"
+		"    -i                           # only write ACLs that differ\n"
+		"    -j <threads>                 # number of worker threads\n"
+		"    -n                           # dry run, count what would change and change nothing\n"
+		"    -e <path>                    # exclude path and everything below it, may be repeated\n"
+		"    -p <path>                    # path to recursively set ACL, may be repeated\n"
+		"    -P <file|fd>                 # write progress to file or descriptor every second\n"
+		"    -S <percent>                 # with -n, only check ACLs in this share of directories\n"
+		"    -u                           # unsorted, classify entries by d_type where possible\n"
 		"    -v                           # verbose\n",
 		path
 	);
@@ -190,10 +241,19 @@ usage(char *path)
 		"    -a <clone|reset> 		# action to perform\n"
 		"    -O <owner>                	# change owner\n"
 		"    -G <group>                	# change group\n"
+		"    -F                        	# use the path based fts walker\n"
 		"    -s <source>         	# source (if cloning ACL). If none specified then ACL taken from -p\n"
-		"    -p <path>                 	# path to set\n"
+		"    -i                        	# incremental, only write ACLs and owners that differ\n"
+		"    -e <path>                 	# exclude path and everything below it, may be repeated\n"
+		"    -E <fix|append>           	# also fix AFP or append a null byte to extended attributes, may be repeated\n"
+		"    -p <path>                 	# path to set, may be repeated\n"
+		"    -P <file|fd>              	# write progress to file or descriptor every second\n"
+		"    -S <percent>              	# with -n, only check ACLs in this share of directories\n"
+		"    -j <threads>              	# number of worker threads (with -r, not with -F)\n"
 		"    -l                        	# do not traverse symlinks\n"
+		"    -n                        	# dry run, count what would change and change nothing\n"
 		"    -r                        	# recursive\n"
+		"    -u                        	# unsorted, classify entries by d_type where possible\n"
 		"    -v                        	# verbose\n"
 		"    -x                        	# traverse filesystem mountpoints\n",
 		path
@@ -259,46 +319,329 @@ remove_inherit_flags(acl_t *acl)
 }
 
 static int
-set_windows_acl(struct windows_acl_info *w, FTSENT *fts_entry)
+ace_from_entry(acl_entry_t entry, struct windows_ace *ace)
 {
-	char *path;
-	char *buf;
-	acl_t acl_new;
-	if (fts_entry == NULL) 
-		path = w->path;
-	else
-		path = fts_entry->fts_accpath;
+	acl_tag_t tag;
+	acl_permset_t perms;
+	acl_flagset_t flags;
+	acl_entry_type_t type;
+	id_t *id;
+
+	if (acl_get_tag_type(entry, &tag) < 0 ||
+		acl_get_permset(entry, &perms) < 0 ||
+		acl_get_flagset_np(entry, &flags) < 0 ||
+		acl_get_entry_type_np(entry, &type) < 0)
+		return (-1);
+
+	ace->tag = tag;
+	ace->id = ACL_UNDEFINED_ID;
+	ace->perm = *perms;
+	ace->flags = *flags;
+	ace->type = type;
+
+	if (tag == ACL_USER || tag == ACL_GROUP) {
+		if ((id = acl_get_qualifier(entry)) == NULL)
+			return (-1);
+		ace->id = *id;
+		acl_free(id);
+	}
+
+	return (0);
+}
+
+
+/* done once per template, so -i only has to walk the on-disk ACL */
+static void
+acl_to_bin(acl_t acl, struct windows_acl_bin *bin)
+{
+	int entry_id;
+	acl_entry_t acl_entry;
+
+	free(bin->aces);
+	if ((bin->aces = calloc(ACL_MAX_ENTRIES, sizeof(*bin->aces))) == NULL)
+		err(EX_OSERR, "calloc() failed");
+	bin->count = 0;
+	if (acl == NULL)
+		return;
+
+	entry_id = ACL_FIRST_ENTRY;
+	while (acl_get_entry(acl, entry_id, &acl_entry) > 0) {
+		entry_id = ACL_NEXT_ENTRY;
+
+		if (ace_from_entry(acl_entry, &bin->aces[bin->count]) < 0)
+			err(EX_OSERR, "ace_from_entry() failed");
+		bin->count++;
+	}
+}
+
+
+/* entry order matters for NFSv4 ACLs, so this is a straight compare */
+static int
+acl_matches_bin(acl_t acl, const struct windows_acl_bin *bin)
+{
+	int i, entry_id;
+	acl_entry_t acl_entry;
+	struct windows_ace ace;
+
+	i = 0;
+	entry_id = ACL_FIRST_ENTRY;
+	while (acl_get_entry(acl, entry_id, &acl_entry) > 0) {
+		entry_id = ACL_NEXT_ENTRY;
+
+		if (i >= bin->count || ace_from_entry(acl_entry, &ace) < 0 ||
+			memcmp(&ace, &bin->aces[i], sizeof(ace)) != 0)
+			return (0);
+		i++;
+	}
+
+	return (i == bin->count);
+}
+
+
+static int
+owner_matches(struct windows_acl_info *w, struct stat *st)
+{
+	return ((w->uid == -1 || st->st_uid == w->uid) &&
+		(w->gid == -1 || st->st_gid == w->gid));
+}
+
+
+acl_t
+get_windows_acl(struct windows_acl_info *w, int level, int isdir,
+	struct windows_acl_bin **bin)
+{
+	/* don't set inherited flag on root dir. This is required for zfsacl:map_dacl_protected */
+	if (level == FTS_ROOTLEVEL) {
+		*bin = &w->source_bin;
+		return (w->source_acl);
+	}
+
+	/* the last template holds for everything further down */
+	if (w->ntemplates > 0) {
+		struct windows_acl_template *t;
+
+		t = &w->templates[(level < w->ntemplates ? level : w->ntemplates) - 1];
+		*bin = isdir ? &t->dacl_bin : &t->facl_bin;
+		return (isdir ? t->dacl : t->facl);
+	}
+
+	*bin = isdir ? &w->dacl_bin : &w->facl_bin;
+	return (isdir ? w->dacl : w->facl);
+}
+
+
+void
+count_windows_acl(struct windows_acl_stats *stats, int ret)
+{
+	if (ret == 0)
+		stats->written++;
+	else if (ret > 0)
+		stats->skipped++;
+}
+
+
+void
+flush_windows_acl_stats(struct windows_acl_info *w,
+	struct windows_acl_stats *stats)
+{
+	pthread_mutex_lock(&w->stats_lock);
+	w->stats.visited += stats->visited;
+	w->stats.written += stats->written;
+	w->stats.skipped += stats->skipped;
+	w->stats.errors += stats->errors;
+	w->stats.dirs += stats->dirs;
+	w->stats.files += stats->files;
+	w->stats.mounts += stats->mounts;
+	pthread_mutex_unlock(&w->stats_lock);
+
+	memset(stats, 0, sizeof(*stats));
+}
+
+
+/* path is only used for messages, everything goes through fd */
+int
+set_windows_acl_fd(struct windows_acl_info *w, int fd, const char *path,
+	int level, int isdir)
+{
+	struct windows_acl_bin *bin;
+	struct stat st;
+	acl_t acl_new, acl_cur;
+	bool set_acl = true, set_owner = (w->uid != -1 || w->gid != -1);
 
 	if (w->flags & WA_VERBOSE)
 		fprintf(stdout, "%s\n", path);
 
-	/* don't set inherited flag on root dir. This is required for zfsacl:map_dacl_protected */
-        if (fts_entry->fts_level == FTS_ROOTLEVEL) {
-                acl_new = w->source_acl;
-        }
-        else {
-                acl_new = ((fts_entry->fts_statp->st_mode & S_IFDIR) == 0) ? w->facl : w->dacl;
-        }
+	if ((acl_new = get_windows_acl(w, level, isdir, &bin)) == NULL)
+		set_acl = false;
+
+	/* nothing to inherit and no owner to change, so nothing gets written */
+	if (!set_acl && !set_owner)
+		return (1);
+
+	if (w->flags & (WA_INCREMENTAL|WA_DRYRUN)) {
+		if (set_acl &&
+			(acl_cur = acl_get_fd_np(fd, ACL_TYPE_NFS4)) != NULL) {
+			set_acl = !acl_matches_bin(acl_cur, bin);
+			acl_free(acl_cur);
+		}
+		if (set_owner && fstat(fd, &st) == 0)
+			set_owner = !owner_matches(w, &st);
+		if (!set_acl && !set_owner)
+			return (1);
+	}
+
+	/* -n only wants to know */
+	if (w->flags & WA_DRYRUN)
+		return (0);
+
+	if (set_acl && acl_set_fd_np(fd, acl_new, ACL_TYPE_NFS4) < 0) {
+		warn("%s: acl_set_fd_np() failed", path);
+		return (-1);
+	}
+
+	if (set_owner) {
+		if (fchown(fd, w->uid, w->gid) < 0) {
+			warn("%s: fchown() failed", path);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+
+int
+set_windows_acl_path(struct windows_acl_info *w, const char *path,
+	int level, int isdir)
+{
+	struct windows_acl_bin *bin;
+	struct stat st;
+	acl_t acl_new, acl_cur;
+	bool set_acl = true, set_owner = (w->uid != -1 || w->gid != -1);
+
+	if (w->flags & WA_VERBOSE)
+		fprintf(stdout, "%s\n", path);
+
+	if ((acl_new = get_windows_acl(w, level, isdir, &bin)) == NULL)
+		set_acl = false;
+
+	/* nothing to inherit and no owner to change, so nothing gets written */
+	if (!set_acl && !set_owner)
+		return (1);
+
+	if (w->flags & (WA_INCREMENTAL|WA_DRYRUN)) {
+		if (set_acl &&
+			(acl_cur = acl_get_file(path, ACL_TYPE_NFS4)) != NULL) {
+			set_acl = !acl_matches_bin(acl_cur, bin);
+			acl_free(acl_cur);
+		}
+		if (set_owner && stat(path, &st) == 0)
+			set_owner = !owner_matches(w, &st);
+		if (!set_acl && !set_owner)
+			return (1);
+	}
+
+	if (w->flags & WA_DRYRUN)
+		return (0);
 
 	/* write out the acl to the file */
 
-	if (acl_set_file(path, ACL_TYPE_NFS4, acl_new) < 0) {
+	if (set_acl && acl_set_file(path, ACL_TYPE_NFS4, acl_new) < 0) {
 		warn("%s: acl_set_file() failed", path);
 		return (-1);
 	}
 
-	if (w->uid != -1 || w->gid != -1) {
+	if (set_owner) {
 		if (chown(path, w->uid, w->gid) < 0) {
 			warn("%s: chown() failed", path);
 			return (-1);
 		}
 	}
 
- 
 	return (0);
 }
 
 
+/*
+ * -E does what fix_ea -f and -a would, while the walk has the entry open
+ * anyway, so that a share can be reset and repaired in one pass.
+ */
+int
+fix_windows_acl_ea(struct windows_acl_info *w, int fd, const char *path,
+	struct ea_arena *a)
+{
+	u_int64_t flags = w->ea_flags;
+
+	if (flags == EA_NONE)
+		return (0);
+	if (w->flags & WA_DRYRUN)
+		flags |= EA_DRY_RUN;
+
+	if (ea_fix_fd(fd, path, NULL, flags, a, stdout) != 0)
+		return (-1);
+
+	return (0);
+}
+
+
+int
+skip_windows_acl(struct windows_acl_info *w, const char *path)
+{
+	int i;
+
+	for (i = 0;i < w->nexcludes;i++) {
+		if (strcmp(w->excludes[i], path) == 0)
+			return (1);
+	}
+
+	return (0);
+}
+
+
+int
+sample_windows_acl(struct windows_acl_info *w, const char *path, size_t len,
+	int level)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	if (w->sample >= 100 || level <= FTS_ROOTLEVEL)
+		return (1);
+
+	/* FNV-1a, so that every run and both walkers pick the same ones */
+	for (i = 0;i < len;i++)
+		hash = (hash ^ (unsigned char)path[i]) * 16777619U;
+
+	return (hash % 100 < (uint32_t)w->sample);
+}
+
+
+static int
+set_windows_acl(struct windows_acl_info *w, FTSENT *fts_entry,
+	struct windows_acl_stats *stats, struct ea_arena *a)
+{
+	int fd, ret;
+
+	ret = set_windows_acl_path(w, fts_entry->fts_accpath,
+		fts_entry->fts_level, S_ISDIR(fts_entry->fts_statp->st_mode));
+	count_windows_acl(stats, ret);
+
+	if (w->ea_flags != EA_NONE && ret >= 0) {
+		if ((fd = open(fts_entry->fts_accpath,
+			O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+			warn("%s: open() failed", fts_entry->fts_accpath);
+			stats->errors++;
+		} else {
+			if (fix_windows_acl_ea(w, fd, fts_entry->fts_accpath, a) < 0)
+				stats->errors++;
+			close(fd);
+		}
+	}
+
+	return (ret);
+}
+
+
 static int
 fts_compare(const FTSENT * const *s1, const FTSENT * const *s2)
 {
@@ -311,16 +654,14 @@ set_windows_acls(struct windows_acl_info *w)
 {
 	FTS *tree;
 	FTSENT *entry;
+	struct windows_acl_stats stats;
+	struct ea_arena arena;
 	int options = 0;
-	char *paths[4];
 	int rval;
 
 	if (w == NULL)
 		return (-1);
 
-	paths[0] = w->path;
-	paths[1] = NULL;
-
 	if ((w->flags & WA_TRAVERSE) == 0 ) {
 		options |= FTS_XDEV;
 	}
@@ -328,29 +669,68 @@ set_windows_acls(struct windows_acl_info *w)
 		options |= FTS_LOGICAL;	
 	}
 
-	if ((tree = fts_open(paths, options, fts_compare)) == NULL)
+	/*
+	 * The order only matters to someone reading -v output. FTS_NOSTAT
+	 * is no help here, it would not tell regular files from symlinks.
+	 */
+	if ((tree = fts_open(w->paths, options,
+		(w->flags & WA_UNORDERED) ? NULL : fts_compare)) == NULL)
 		err(EX_OSERR, "fts_open");
 
+	memset(&stats, 0, sizeof(stats));
+	memset(&arena, 0, sizeof(arena));
+
 	/* traverse directory hierarchy */
 	for (rval = 0; (entry = fts_read(tree)) != NULL;) {
+		if (entry->fts_info == FTS_DP)
+			continue;
+
+		if (skip_windows_acl(w, entry->fts_path)) {
+			if (entry->fts_info == FTS_D)
+				fts_set(tree, entry, FTS_SKIP);
+			continue;
+		}
+
+		/* only hand them over now and then, -P does not need more */
+		if (++stats.visited % WA_FLUSH_COUNT == 0)
+			flush_windows_acl_stats(w, &stats);
+
+		/* every root, but nothing below them */
 		if ((w->flags & WA_RECURSIVE) == 0) {
-			if (entry->fts_level == FTS_ROOTLEVEL){
-				rval = set_windows_acl(w, entry);
-				break;
+			if (entry->fts_level == FTS_ROOTLEVEL) {
+				if (S_ISDIR(entry->fts_statp->st_mode))
+					stats.dirs++;
+				else
+					stats.files++;
+				rval = set_windows_acl(w, entry, &stats, &arena);
+				fts_set(tree, entry, FTS_SKIP);
 			}
+			continue;
 		}
 
 		switch (entry->fts_info) {
 			case FTS_D:
-				rval = set_windows_acl(w, entry);
+				stats.dirs++;
+				if (entry->fts_level > FTS_ROOTLEVEL &&
+					entry->fts_dev != entry->fts_parent->fts_dev)
+					stats.mounts++;
+				if (sample_windows_acl(w, entry->fts_path,
+					entry->fts_pathlen, entry->fts_level))
+					rval = set_windows_acl(w, entry, &stats, &arena);
 				break;	
 
 			case FTS_F:
-				rval = set_windows_acl(w, entry);
+				/* files go with the directory they are in */
+				stats.files++;
+				if (sample_windows_acl(w, entry->fts_path,
+					entry->fts_parent->fts_pathlen,
+					entry->fts_level - 1))
+					rval = set_windows_acl(w, entry, &stats, &arena);
 				break;	
 
 			case FTS_ERR:
 				warnx("%s: %s", entry->fts_path, strerror(entry->fts_errno));
+				stats.errors++;
 				rval = -2;
 				continue;
 		}
@@ -361,6 +741,8 @@ set_windows_acls(struct windows_acl_info *w)
 
 	} 
 
+	flush_windows_acl_stats(w, &stats);
+	ea_arena_free(&arena);
 	return (rval);
 }
 
@@ -372,13 +754,20 @@ usage_check(struct windows_acl_info *w)
 		errx(EX_USAGE, "no path specified");
 
 	if (!WA_OP_CHECK(w->flags, ~WA_OP_SET) &&
-		w->dacl == NULL && w->facl == NULL)
+		w->dacl == NULL && w->facl == NULL && w->ntemplates == 0)
 		errx(EX_USAGE, "nothing to do");
 
 	if (WA_OP_CHECK(w->flags, ~WA_OP_SET) &&
-		w->dacl == NULL && w->facl == NULL && !(w->flags & WA_RESET)) {
+		w->dacl == NULL && w->facl == NULL && w->ntemplates == 0 &&
+		!(w->flags & WA_RESET)) {
 		errx(EX_USAGE, "no entries specified and not resetting");
 	}
+
+	if ((w->flags & WA_LEGACY) && w->nthreads > 1)
+		errx(EX_USAGE, "-j cannot be used with -F");
+
+	if ((w->flags & WA_DRYRUN) == 0 && w->sample < 100)
+		errx(EX_USAGE, "-S only makes sense with -n");
 }
 
 
@@ -415,32 +804,172 @@ make_acls(struct windows_acl_info *w)
 	remove_inherit_flags(&w->facl);
 	set_inherited_flag(&w->facl);	
 
+	acl_to_bin(w->source_acl, &w->source_bin);
+	acl_to_bin(w->dacl, &w->dacl_bin);
+	acl_to_bin(w->facl, &w->facl_bin);
+
 	acl_free(acl);
 }
 
+/*
+ * The ACL a new file or directory below parent would get: entries it
+ * inherits, with the inheritance flags a child keeps, marked inherited.
+ * NULL if it inherits nothing.
+ */
+static acl_t
+inherit_acl(acl_t parent, int isdir)
+{
+	int entry_id, fi, di, np, count = 0;
+	acl_entry_t acl_entry, new_entry;
+	acl_flagset_t acl_flags;
+	acl_t acl;
+
+	if ((acl = acl_init(ACL_MAX_ENTRIES)) == NULL)
+		err(EX_OSERR, "acl_init() failed");
+
+	entry_id = ACL_FIRST_ENTRY;
+	while (acl_get_entry(parent, entry_id, &acl_entry) > 0) {
+		entry_id = ACL_NEXT_ENTRY;
+
+		if (acl_get_flagset_np(acl_entry, &acl_flags) < 0)
+			err(EX_OSERR, "acl_get_flagset_np() failed");
+		fi = acl_get_flag_np(acl_flags, ACL_ENTRY_FILE_INHERIT) == 1;
+		di = acl_get_flag_np(acl_flags, ACL_ENTRY_DIRECTORY_INHERIT) == 1;
+		np = acl_get_flag_np(acl_flags, ACL_ENTRY_NO_PROPAGATE_INHERIT) == 1;
+
+		/* directories pass file inherit entries on, unless told not to */
+		if (isdir ? !(di || (fi && !np)) : !fi)
+			continue;
+
+		if (acl_create_entry(&acl, &new_entry) < 0)
+			err(EX_OSERR, "acl_create_entry() failed");
+		if (acl_copy_entry(new_entry, acl_entry) < 0)
+			err(EX_OSERR, "acl_copy_entry() failed");
+		if (acl_get_flagset_np(new_entry, &acl_flags) < 0)
+			err(EX_OSERR, "acl_get_flagset_np() failed");
+
+		if (!isdir || np)
+			acl_delete_flag_np(acl_flags, (
+				ACL_ENTRY_FILE_INHERIT|ACL_ENTRY_DIRECTORY_INHERIT|
+				ACL_ENTRY_NO_PROPAGATE_INHERIT|ACL_ENTRY_INHERIT_ONLY
+				));
+		else if (di)
+			acl_delete_flag_np(acl_flags, ACL_ENTRY_INHERIT_ONLY);
+		else
+			acl_add_flag_np(acl_flags, ACL_ENTRY_INHERIT_ONLY);
+		acl_add_flag_np(acl_flags, ACL_ENTRY_INHERITED);
+
+		if (acl_set_flagset_np(new_entry, acl_flags) < 0)
+			err(EX_OSERR, "acl_set_flagset_np() failed");
+		count++;
+	}
+
+	if (count == 0) {
+		acl_free(acl);
+		return (NULL);
+	}
+
+	return (acl);
+}
+
+
+static int
+bin_equal(const struct windows_acl_bin *a, const struct windows_acl_bin *b)
+{
+	return (a->count == b->count &&
+		memcmp(a->aces, b->aces, a->count * sizeof(*a->aces)) == 0);
+}
+
+
 static void
 clone_acls(struct windows_acl_info *w)
 {
-	/* create a directory acl */
-	if ((w->dacl = acl_dup(w->source_acl)) == NULL)
-		err(EX_OSERR, "acl_dup() failed");
+	struct windows_acl_template *t;
+	acl_t parent = w->source_acl;
+
+	/*
+	 * What depth n inherits follows from what the directories at depth
+	 * n - 1 got, and NO_PROPAGATE_INHERIT and INHERIT_ONLY entries make
+	 * that differ for the first levels. Work the templates out once, up
+	 * to the first level that looks like the one above it, rather than
+	 * going back to the source for every entry.
+	 */
+	while (parent != NULL) {
+		if ((w->templates = realloc(w->templates,
+			(w->ntemplates + 1) * sizeof(*w->templates))) == NULL)
+			err(EX_OSERR, "realloc() failed");
+
+		t = &w->templates[w->ntemplates];
+		memset(t, 0, sizeof(*t));
+		t->dacl = inherit_acl(parent, 1);
+		t->facl = inherit_acl(parent, 0);
+		acl_to_bin(t->dacl, &t->dacl_bin);
+		acl_to_bin(t->facl, &t->facl_bin);
+
+		if (w->ntemplates > 0 &&
+			bin_equal(&t->dacl_bin, &t[-1].dacl_bin) &&
+			bin_equal(&t->facl_bin, &t[-1].facl_bin)) {
+			acl_free(t->dacl);
+			acl_free(t->facl);
+			free(t->dacl_bin.aces);
+			free(t->facl_bin.aces);
+			break;
+		}
 
-	set_inherited_flag(&w->dacl);
+		parent = t->dacl;
+		w->ntemplates++;
+	}
 
-	/* create a file acl */
-	if ((w->facl = acl_dup(w->source_acl)) == NULL)
-		err(EX_OSERR, "acl_dup() failed");
-	remove_inherit_flags(&w->facl);
-	set_inherited_flag(&w->facl);
+	/*
+	 * Directories that inherit nothing pass nothing on, so below the
+	 * last template that still has something for files there is one
+	 * that has nothing at all, rather than that last one carrying on.
+	 */
+	if (parent == NULL && w->ntemplates > 0 &&
+		w->templates[w->ntemplates - 1].facl != NULL) {
+		if ((w->templates = realloc(w->templates,
+			(w->ntemplates + 1) * sizeof(*w->templates))) == NULL)
+			err(EX_OSERR, "realloc() failed");
+
+		t = &w->templates[w->ntemplates];
+		memset(t, 0, sizeof(*t));
+		acl_to_bin(NULL, &t->dacl_bin);
+		acl_to_bin(NULL, &t->facl_bin);
+		w->ntemplates++;
+	}
+
+	acl_to_bin(w->source_acl, &w->source_bin);
+}
+
+/* what -n found, with the changes scaled up to every entry if -S */
+static void
+print_plan(struct windows_acl_info *w, const char *label)
+{
+	struct windows_acl_stats *s = &w->stats;
+	uintmax_t checked, total, estimate;
+
+	checked = s->written + s->skipped;
+	total = s->dirs + s->files;
+	estimate = s->written;
+	if (checked > 0 && checked < total)
+		estimate = (double)s->written * total / checked;
+
+	fprintf(stdout, "%s: %ju directories, %ju files, %ju mountpoints\n",
+		label, s->dirs, s->files, s->mounts);
+	fprintf(stdout, "%s: %ju of %ju entries checked would change, "
+		"about %ju in all\n", label, s->written, checked, estimate);
 }
 
 int
 main(int argc, char **argv)
 {
-	int 	ch, ret;
+	int 	ch, ret = 0;
 	struct 	windows_acl_info *w;
 	acl_t	source_acl;
+	const char *errstr;
+	char *progress = NULL;
 	char *p = argv[0];
+	char label[PATH_MAX + 32];
 
 	if (argc < 2)
 		usage(argv[0]);
@@ -450,13 +979,42 @@ main(int argc, char **argv)
 	if (strcmp(p, "cloneacl") == 0) {
 		w->flags |= WA_CLONE;
 		w->flags |= WA_RECURSIVE;
-		while ((ch = getopt(argc, argv, "s:p:v")) != -1) {
+		while ((ch = getopt(argc, argv, "e:Fij:ns:S:p:P:uv")) != -1) {
 			switch(ch) {
+			case 'e':
+				addarg(&w->excludes, &w->nexcludes, optarg);
+				break;
+			case 'F':
+				w->flags |= WA_LEGACY;
+				break;
+			case 'i':
+				w->flags |= WA_INCREMENTAL;
+				break;
+			case 'j':
+				w->nthreads = strtonum(optarg, 1, WA_MAX_THREADS, &errstr);
+				if (errstr != NULL)
+					errx(EX_USAGE, "number of threads is %s: %s", errstr, optarg);
+				break;
+			case 'n':
+				w->flags |= WA_DRYRUN;
+				break;
 			case 's':
 				setarg(&w->source, optarg);
 				break;
+			case 'S':
+				w->sample = strtonum(optarg, 1, 100, &errstr);
+				if (errstr != NULL)
+					errx(EX_USAGE, "sample percentage is %s: %s", errstr, optarg);
+				break;
 			case 'p':
-				setarg(&w->path, optarg);
+				addarg(&w->paths, &w->npaths, optarg);
+				w->path = w->paths[0];
+				break;
+			case 'P':
+				progress = optarg;
+				break;
+			case 'u':
+				w->flags |= WA_UNORDERED;
 				break;
 			case 'v':
 				w->flags |= WA_VERBOSE;
@@ -467,7 +1025,7 @@ main(int argc, char **argv)
 			}
 		}
 	} else {
-		while ((ch = getopt(argc, argv, "a:O:G:s:p:lrvx")) != -1) {
+		while ((ch = getopt(argc, argv, "a:O:G:e:E:Fij:s:S:p:P:lnruvx")) != -1) {
 			switch (ch) {
 				case 'a': {
 					int action = get_action(optarg);
@@ -495,22 +1053,68 @@ main(int argc, char **argv)
 					break;
 				}
 
+				case 'e':
+					addarg(&w->excludes, &w->nexcludes, optarg);
+					break;
+
+				case 'E':
+					if (strcasecmp(optarg, "fix") == 0)
+						w->ea_flags |= EA_FIX_AFP_EA;
+					else if (strcasecmp(optarg, "append") == 0)
+						w->ea_flags |= (EA_APPEND_NULL_ALL | EA_APPEND_NULL);
+					else
+						errx(EX_USAGE, "invalid repair: %s", optarg);
+					break;
+
+				case 'F':
+					w->flags |= WA_LEGACY;
+					break;
+
+				case 'i':
+					w->flags |= WA_INCREMENTAL;
+					break;
+
+				case 'j':
+					w->nthreads = strtonum(optarg, 1, WA_MAX_THREADS, &errstr);
+					if (errstr != NULL)
+						errx(EX_USAGE, "number of threads is %s: %s", errstr, optarg);
+					break;
+
 				case 's':
 					setarg(&w->source, optarg);
 					break;
 
+				case 'S':
+					w->sample = strtonum(optarg, 1, 100, &errstr);
+					if (errstr != NULL)
+						errx(EX_USAGE, "sample percentage is %s: %s", errstr, optarg);
+					break;
+
 				case 'l':
 					w->flags |= WA_PHYSICAL;
 					break;
 
+				case 'n':
+					w->flags |= WA_DRYRUN;
+					break;
+
 				case 'p':
-					setarg(&w->path, optarg);
+					addarg(&w->paths, &w->npaths, optarg);
+					w->path = w->paths[0];
+					break;
+
+				case 'P':
+					progress = optarg;
 					break;
 
 				case 'r':
 					w->flags |= WA_RECURSIVE;
 					break;
 
+				case 'u':
+					w->flags |= WA_UNORDERED;
+					break;
+
 				case 'v':
 					w->flags |= WA_VERBOSE;
 					break;
@@ -555,10 +1159,34 @@ main(int argc, char **argv)
 
 	usage_check(w);
 
-	if (set_windows_acls(w) <0) {
+	if (progress != NULL && start_windows_acl_progress(w, progress) < 0)
+		err(EX_CANTCREAT, "%s: cannot open progress file", progress);
+
+	if (w->flags & WA_LEGACY) {
+		if (set_windows_acls(w) <0)
+			ret = 1;
+	} else if (walk_windows_acls(w) < 0) {
 		ret = 1;
 	}
 
+	stop_windows_acl_progress(w);
+
+	/* -E carries on past attributes it could not repair, but says so */
+	if (w->ea_flags != EA_NONE && w->stats.errors > 0)
+		ret = 1;
+
+	if (w->npaths > 1)
+		snprintf(label, sizeof(label), "%s and %d more",
+			w->path, w->npaths - 1);
+	else
+		strlcpy(label, w->path, sizeof(label));
+
+	if (w->flags & WA_DRYRUN)
+		print_plan(w, label);
+	else if (w->flags & WA_INCREMENTAL)
+		fprintf(stdout, "%s: %ju written, %ju skipped\n",
+			label, w->stats.written, w->stats.skipped);
+
 	free_windows_acl_info(w);
 	return (ret);
 }
@@ -0,0 +1,152 @@
+/*-
+ * Copyright 2014 iXsystems, Inc.
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef	__WINACL_H
+#define	__WINACL_H
+
+#include <sys/types.h>
+#include <sys/acl.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ea.h"
+
+/* canonical form of an ACL entry, whole ACLs compare with memcmp() */
+struct windows_ace {
+	uint32_t	tag;
+	uint32_t	id;
+	uint32_t	perm;
+	uint32_t	flags;
+	uint32_t	type;
+};
+
+struct windows_acl_bin {
+	int	count;
+	struct windows_ace *aces;
+};
+
+/* what entries at one depth below a cloned root inherit */
+struct windows_acl_template {
+	acl_t	dacl;			/* NULL if nothing is inherited */
+	acl_t	facl;
+	struct windows_acl_bin dacl_bin;
+	struct windows_acl_bin facl_bin;
+};
+
+/* with -n, written and skipped count what would be and need not be written */
+struct windows_acl_stats {
+	uintmax_t	visited;
+	uintmax_t	written;
+	uintmax_t	skipped;
+	uintmax_t	errors;
+	uintmax_t	dirs;
+	uintmax_t	files;
+	uintmax_t	mounts;		/* directories on another device than their parent */
+};
+
+struct windows_acl_progress;
+
+struct windows_acl_info {
+
+#define	WA_NULL			0x00000000	/* nothing */
+#define	WA_RECURSIVE		0x00000001	/* recursive */
+#define	WA_VERBOSE		0x00000002	/* print more stuff */
+#define	WA_RESET		0x00000004	/* set defaults */
+#define	WA_CLONE		0x00000008	/* clone an ACL */
+#define	WA_TRAVERSE		0x00000010	/* traverse filesystem mountpoints */
+#define	WA_PHYSICAL		0x00000020	/* do not follow symlinks */
+#define	WA_LEGACY		0x00000040	/* path based fts walker */
+#define	WA_INCREMENTAL		0x00000080	/* only write what differs */
+#define	WA_UNORDERED		0x00000100	/* no sorting, trust d_type */
+#define	WA_DRYRUN		0x00000200	/* count, but change nothing */
+
+/* default ACL entries if none are specified */
+#define	WA_DEFAULT_ACL		"owner@:rwxpDdaARWcCos:fd:allow,group@:rwxpDdaARWcCos:fd:allow,everyone@:rxaRc:fd:allow"
+
+#define	WA_OP_SET	(WA_CLONE|WA_RESET)
+#define	WA_OP_CHECK(flags, bit) ((flags & ~bit) & WA_OP_SET)
+
+/* upper bound for -j */
+#define	WA_MAX_THREADS		256
+
+/* entries counted privately before the totals get them */
+#define	WA_FLUSH_COUNT		256
+
+	char *source;
+	char *path;			/* the first of paths */
+	char **paths;			/* -p, NULL terminated */
+	int	npaths;
+	char **excludes;		/* -e */
+	int	nexcludes;
+	acl_t source_acl;
+	acl_t dacl;
+	acl_t facl;
+	struct windows_acl_bin source_bin;
+	struct windows_acl_bin dacl_bin;
+	struct windows_acl_bin facl_bin;
+	struct windows_acl_template *templates;	/* by depth, when cloning */
+	int	ntemplates;
+	uid_t uid;
+	gid_t gid;
+	int	flags;
+	u_int64_t ea_flags;		/* -E, EA_* repairs to make on the way */
+	int	nthreads;
+	int	sample;			/* -S, percent of directories -n checks */
+	struct windows_acl_stats stats;		/* totals, under stats_lock */
+	pthread_mutex_t stats_lock;
+	struct windows_acl_progress *progress;	/* -P */
+};
+
+/* NULL if the entry has nothing to inherit and its ACL is left alone */
+acl_t get_windows_acl(struct windows_acl_info *, int, int,
+	struct windows_acl_bin **);
+
+/* return 0 if the entry was written, 1 if -i found nothing to change */
+int set_windows_acl_fd(struct windows_acl_info *, int, const char *, int, int);
+int set_windows_acl_path(struct windows_acl_info *, const char *, int, int);
+
+/* return -1 if -E found attributes that are or stay corrupted */
+int fix_windows_acl_ea(struct windows_acl_info *, int, const char *,
+	struct ea_arena *);
+
+/* return 1 if path was excluded with -e */
+int skip_windows_acl(struct windows_acl_info *, const char *);
+
+/* return 1 if the entries of directory path[0..len) get checked by -n */
+int sample_windows_acl(struct windows_acl_info *, const char *, size_t, int);
+
+void count_windows_acl(struct windows_acl_stats *, int);
+
+/* add stats to the totals in w and start them over */
+void flush_windows_acl_stats(struct windows_acl_info *, struct windows_acl_stats *);
+
+int walk_windows_acls(struct windows_acl_info *);
+
+int start_windows_acl_progress(struct windows_acl_info *, const char *);
+void stop_windows_acl_progress(struct windows_acl_info *);
+
+#endif /* __WINACL_H */